@@ -0,0 +1,373 @@
+#include "asterales/aeon.hh"
+#include "asterales/cicada.hh"
+#include "asterales/time.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace aeon = asterales::aeon;
+namespace cicada = asterales::cicada;
+
+typedef asterales::time::keeper<asterales::time::clock_type::monotonic> bench_clock;
+
+static constexpr size_t zerocopy_total = 256 << 20;
+static constexpr size_t echo_chunk = 16 << 10;
+static constexpr size_t echo_window = 64 << 10;
+static constexpr size_t rr_size = 64;
+
+static size_t bench_clients = 16;
+static double bench_seconds = 2;
+static cicada::reactor::trigger_mode bench_trigger = cicada::reactor::trigger_mode::oneshot;
+
+static uint64_t mono_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * NANO + ts.tv_nsec;
+}
+
+// connected loopback tcp pair, the first descriptor is nonblocking and the second is blocking
+static bool loopback_pair(int & client, int & server) {
+	int lfd = ::socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0) return false;
+	sockaddr_in addr {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t alen = sizeof(addr);
+	if (bind(lfd, reinterpret_cast<sockaddr *>(&addr), alen) || ::listen(lfd, 1) || getsockname(lfd, reinterpret_cast<sockaddr *>(&addr), &alen)) {
+		::close(lfd);
+		return false;
+	}
+	client = ::socket(AF_INET, SOCK_STREAM, 0);
+	if (::connect(client, reinterpret_cast<sockaddr *>(&addr), alen)) {
+		::close(lfd);
+		::close(client);
+		return false;
+	}
+	server = ::accept(lfd, nullptr, nullptr);
+	::close(lfd);
+	fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+	return server >= 0;
+}
+
+static void wait_for(int fd, short events) {
+	pollfd pfd { fd, events, 0 };
+	poll(&pfd, 1, 100);
+}
+
+// ================================================================================================
+// ZEROCOPY
+
+static aeon::object zerocopy_run(size_t size, bool zerocopy) {
+	aeon::object ret = aeon::map();
+	ret["size"] = size;
+	
+	int cfd, sfd;
+	if (!loopback_pair(cfd, sfd)) {
+		ret["error"] = "could not create loopback pair";
+		return ret;
+	}
+	cicada::socket sock;
+	sock.FD = cfd;
+	cicada::connection con { std::move(sock) };
+	bool zc = zerocopy && con.zerocopy();
+	ret["mode"] = zc ? "zerocopy" : zerocopy ? "zerocopy_unavailable" : "copy";
+	
+	auto buf = std::make_shared<asterales::buffer_assembly>();
+	buf->resize(size);
+	memset(buf->data(), 0x5A, size);
+	size_t iterations = zerocopy_total / size;
+	size_t total = iterations * size;
+	
+	std::thread sink { [sfd, total](){
+		std::vector<char> rbuf (1 << 20);
+		size_t got = 0;
+		while (got < total) {
+			ssize_t e = recv(sfd, rbuf.data(), rbuf.size(), 0);
+			if (e <= 0) break;
+			got += e;
+		}
+	} };
+	
+	bench_clock clk;
+	clk.mark();
+	bool failed = false;
+	for (size_t i = 0; i < iterations && !failed; i++) {
+		size_t offset = 0;
+		while (offset < size) {
+			ssize_t e = zc ? con.write_zerocopy(buf, offset) : con.write(reinterpret_cast<char const *>(buf->data()) + offset, size - offset);
+			if (e < 0) {
+				failed = true;
+				break;
+			}
+			if (e == 0) {
+				if (zc) con.reap_zerocopy();
+				wait_for(cfd, POLLOUT);
+			}
+			offset += e;
+		}
+		if (zc) con.reap_zerocopy();
+	}
+	while (zc && !failed && con.zerocopy_pending()) {
+		wait_for(cfd, 0);
+		con.reap_zerocopy();
+	}
+	sink.join();
+	auto span = clk.mark();
+	::close(sfd);
+	
+	if (failed) ret["error"] = "send failed";
+	ret["bytes"] = total;
+	ret["seconds"] = span.sec();
+	ret["mib_per_sec"] = total / span.sec() / (1 << 20);
+	if (zc) ret["copied_completions"] = con.zerocopy_copied();
+	return ret;
+}
+
+static aeon::object bench_zerocopy() {
+	aeon::object results = aeon::array();
+	for (size_t size = 64 << 10; size <= 16 << 20; size <<= 2) {
+		results.array().push_back(zerocopy_run(size, false));
+		results.array().push_back(zerocopy_run(size, true));
+	}
+	return results;
+}
+
+// ================================================================================================
+// REACTOR LOOPBACK
+
+struct bench_state {
+	std::atomic_bool running {true};
+	std::atomic_uint64_t bytes {0};
+	std::atomic_uint64_t completed {0};
+	std::atomic_int64_t inflight {0};
+	std::atomic_int64_t connecting {0}; // connects issued whose client protocol doesn't exist yet
+	std::mutex samples_lock;
+	std::vector<uint64_t> samples;
+};
+
+template <typename P> struct bench_instantiator : public cicada::reactor::protocol_instantiator {
+	bench_state & state;
+	bench_instantiator(bench_state & state) : state(state) {}
+	virtual std::unique_ptr<cicada::reactor::protocol> instantiate() override {
+		auto ret = std::make_unique<P>(state);
+		state.connecting--;
+		return ret;
+	}
+	virtual void connect_failed() override { state.connecting--; }
+};
+
+struct echo_server : public cicada::reactor::protocol {
+	asterales::buffer_assembly buf;
+	virtual cicada::reactor::signal ready(cicada::connection & con, cicada::reactor::detail const &) override {
+		cicada::reactor::signal sig;
+		ssize_t e = con.read(buf);
+		con.queue(std::move(buf));
+		buf = asterales::buffer_assembly {};
+		sig.m = e < 0 ? cicada::reactor::signal::mask::terminate : cicada::reactor::signal::mask::wait_for_read;
+		return sig;
+	}
+	virtual cicada::reactor::signal::mask::type default_mask() override { return cicada::reactor::signal::mask::wait_for_read; }
+};
+
+struct bench_client : public cicada::reactor::protocol {
+	bench_state & state;
+	asterales::buffer_assembly in;
+	bench_client(bench_state & state) : state(state) { state.inflight++; }
+	virtual ~bench_client() { state.inflight--; }
+	virtual cicada::reactor::signal::mask::type default_mask() override { return cicada::reactor::signal::mask::wait_for_read | cicada::reactor::signal::mask::wait_for_write; }
+	static cicada::reactor::signal wait(bool terminate = false) {
+		cicada::reactor::signal sig;
+		sig.m = terminate ? cicada::reactor::signal::mask::terminate : cicada::reactor::signal::mask::wait_for_read;
+		return sig;
+	}
+};
+
+// keeps a window of data in flight and counts what comes back
+struct echo_client : public bench_client {
+	size_t outstanding = 0;
+	using bench_client::bench_client;
+	virtual cicada::reactor::signal ready(cicada::connection & con, cicada::reactor::detail const &) override {
+		if (!state.running) return wait(true);
+		if (con.read(in) < 0) return wait(true);
+		outstanding -= in.size();
+		state.bytes += in.size();
+		in.clear();
+		while (outstanding < echo_window) {
+			asterales::buffer_assembly chunk;
+			memset(chunk.prepare(echo_chunk), 0x33, echo_chunk);
+			chunk.commit(echo_chunk);
+			con.queue(std::move(chunk));
+			outstanding += echo_chunk;
+		}
+		return wait();
+	}
+};
+
+// one small request at a time, samples the round trip
+struct rr_client : public bench_client {
+	uint64_t sent_at = 0;
+	bool awaiting = false;
+	std::vector<uint64_t> samples;
+	using bench_client::bench_client;
+	virtual ~rr_client() {
+		std::lock_guard<std::mutex> lk {state.samples_lock};
+		state.samples.insert(state.samples.end(), samples.begin(), samples.end());
+	}
+	virtual cicada::reactor::signal ready(cicada::connection & con, cicada::reactor::detail const &) override {
+		if (!state.running) return wait(true);
+		if (con.read(in) < 0) return wait(true);
+		while (awaiting && in.size() >= rr_size) {
+			in.discard(rr_size);
+			samples.push_back(mono_ns() - sent_at);
+			awaiting = false;
+		}
+		if (!awaiting) {
+			asterales::buffer_assembly req;
+			memset(req.prepare(rr_size), 0x44, rr_size);
+			req.commit(rr_size);
+			sent_at = mono_ns();
+			con.queue(std::move(req));
+			awaiting = true;
+		}
+		return wait();
+	}
+};
+
+// connect, one exchange, close
+struct churn_client : public bench_client {
+	bool sent = false;
+	using bench_client::bench_client;
+	virtual cicada::reactor::signal ready(cicada::connection & con, cicada::reactor::detail const &) override {
+		if (!sent) {
+			asterales::buffer_assembly req;
+			memset(req.prepare(rr_size), 0x55, rr_size);
+			req.commit(rr_size);
+			con.queue(std::move(req));
+			sent = true;
+			return wait();
+		}
+		if (con.read(in) < 0) return wait(true);
+		if (in.size() < rr_size) return wait();
+		state.completed++;
+		return wait(true);
+	}
+};
+
+static uint16_t free_port() {
+	int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t alen = sizeof(addr);
+	bind(fd, reinterpret_cast<sockaddr *>(&addr), alen);
+	getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &alen);
+	::close(fd);
+	return ntohs(addr.sin_port);
+}
+
+static aeon::object percentiles(std::vector<uint64_t> & samples) {
+	aeon::object ret = aeon::map();
+	ret["count"] = samples.size();
+	if (samples.empty()) return ret;
+	std::sort(samples.begin(), samples.end());
+	auto at = [&](double p){ return samples[std::min(samples.size() - 1, static_cast<size_t>(samples.size() * p))]; };
+	ret["p50_ns"] = at(0.5);
+	ret["p99_ns"] = at(0.99);
+	ret["p999_ns"] = at(0.999);
+	ret["max_ns"] = samples.back();
+	return ret;
+}
+
+template <typename C> static aeon::object reactor_run(bool churn) {
+	unsigned int threads = std::max(2u, std::thread::hardware_concurrency() / 2);
+	uint16_t port = free_port();
+	std::string service = std::to_string(port);
+	
+	cicada::reactor server {true, threads};
+	server.set_trigger_mode(bench_trigger);
+	server.listen<echo_server>(port);
+	cicada::reactor client {true, threads};
+	client.set_trigger_mode(bench_trigger);
+	
+	bench_state state;
+	auto pi = std::make_shared<bench_instantiator<C>>(state);
+	
+	bench_clock clk;
+	clk.mark();
+	uint64_t connects = 0;
+	if (churn) {
+		while (clk.mark_ghost().sec() < bench_seconds) {
+			// connect only resolves and dials in the background, so connects still in progress count against the limit until they become clients or fail
+			while (state.inflight.load() + state.connecting.load() < static_cast<int64_t>(bench_clients)) {
+				state.connecting++;
+				client.connect("127.0.0.1", service, pi);
+				connects++;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+	} else {
+		for (size_t i = 0; i < bench_clients; i++, connects++) {
+			state.connecting++;
+			client.connect("127.0.0.1", service, pi);
+		}
+		std::this_thread::sleep_for(std::chrono::duration<double>(bench_seconds));
+	}
+	state.running.store(false);
+	auto span = clk.mark();
+	
+	aeon::object ret = aeon::map();
+	ret["clients"] = bench_clients;
+	ret["threads_per_reactor"] = threads;
+	ret["trigger"] = bench_trigger == cicada::reactor::trigger_mode::edge ? "edge" : "oneshot";
+	ret["seconds"] = span.sec();
+	ret["connects"] = connects;
+	if (state.bytes) ret["mib_per_sec"] = state.bytes.load() / span.sec() / (1 << 20);
+	if (state.completed) ret["connections_per_sec"] = state.completed.load() / span.sec();
+	
+	std::this_thread::sleep_for(std::chrono::milliseconds(200)); // let clients notice and wind down before the reactors go
+	{
+		std::lock_guard<std::mutex> lk {state.samples_lock};
+		if (!state.samples.empty()) {
+			ret["requests_per_sec"] = state.samples.size() / span.sec();
+			ret["latency"] = percentiles(state.samples);
+		}
+	}
+	ret["server_stats"] = server.stats();
+	return ret;
+}
+
+// ================================================================================================
+
+int main(int argc, char * * argv) {
+	if (argc < 2 || argc > 5) {
+		printf("usage: %s <mode> [clients] [seconds] [oneshot|edge]\n", argv[0]);
+		return 1;
+	}
+	std::string arg = argv[1];
+	if (argc > 2) bench_clients = std::stoul(argv[2]);
+	if (argc > 3) bench_seconds = std::stod(argv[3]);
+	if (argc > 4) bench_trigger = std::string {argv[4]} == "edge" ? cicada::reactor::trigger_mode::edge : cicada::reactor::trigger_mode::oneshot;
+	
+	aeon::object out = aeon::map();
+	if (arg == "echo" || arg == "all") out["echo"] = reactor_run<echo_client>(false);
+	if (arg == "rr" || arg == "all") out["request_response"] = reactor_run<rr_client>(false);
+	if (arg == "churn" || arg == "all") out["churn"] = reactor_run<churn_client>(true);
+	if (arg == "zerocopy" || arg == "all") out["zerocopy"] = bench_zerocopy();
+	if (out.map().empty()) {
+		printf("unknown argument: \"%s\"\nmust be one of:\n> all\n> churn\n> echo\n> rr\n> zerocopy\n", arg.c_str());
+		return 1;
+	}
+	printf("%s\n", out.serialize_text().c_str());
+	return 0;
+}
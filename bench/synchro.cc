@@ -0,0 +1,207 @@
+#include "asterales/aeon.hh"
+#include "asterales/synchro.hh"
+#include "asterales/time.hh"
+
+#include <cstdio>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace aeon = asterales::aeon;
+
+typedef asterales::time::keeper<asterales::time::clock_type::monotonic> bench_clock;
+
+static double bench_seconds = 0.25;
+static size_t bench_max_threads = 64;
+
+// rw_spinlock as it was before the striped counters, every reader goes through the same two flags and one 8 bit count
+struct legacy_rw_spinlock {
+	inline void read_access() {
+		while (accessor.test_and_set()) __asm volatile ("pause" ::: "memory");
+		while (write_sem.test_and_set()) __asm volatile ("pause" ::: "memory");
+		write_sem.clear();
+		readers.fetch_add(1);
+		accessor.clear();
+	}
+	inline void read_done() { readers.fetch_sub(1); }
+	inline void write_lock() {
+		while (accessor.test_and_set()) __asm volatile ("pause" ::: "memory");
+		while (write_sem.test_and_set()) __asm volatile ("pause" ::: "memory");
+		while (readers.load()) __asm volatile ("pause" ::: "memory");
+		accessor.clear();
+	}
+	inline void write_unlock() { write_sem.clear(); }
+private:
+	std::atomic_uint_fast8_t readers {0};
+	std::atomic_flag accessor {false};
+	std::atomic_flag write_sem {false};
+};
+
+// spinlock as it was before backoff and parking, test-and-set in a tight loop
+struct legacy_spinlock {
+	inline void lock() { while (accessor.test_and_set()) __asm volatile ("pause" ::: "memory"); }
+	inline void unlock() { accessor.clear(); }
+private:
+	std::atomic_flag accessor {false};
+};
+
+struct shared_mutex_rw {
+	inline void read_access() { m.lock_shared(); }
+	inline void read_done() { m.unlock_shared(); }
+	inline void write_lock() { m.lock(); }
+	inline void write_unlock() { m.unlock(); }
+private:
+	std::shared_mutex m;
+};
+
+static std::vector<size_t> thread_counts() {
+	std::vector<size_t> ret;
+	for (size_t t = 1; t <= bench_max_threads; t <<= 1) ret.push_back(t);
+	return ret;
+}
+
+// ================================================================================================
+
+// every thread does one write out of <write_every> operations and reads otherwise, a read sums a few shared words and a write bumps them
+template <typename L> static aeon::object rw_run(size_t threads, size_t write_every) {
+	L lock;
+	uint64_t shared [8] {};
+	std::atomic_bool running {true};
+	std::vector<uint64_t> ops (threads, 0);
+	std::vector<std::thread> ths;
+	
+	bench_clock clk;
+	clk.mark();
+	for (size_t t = 0; t < threads; t++) ths.emplace_back([&, t](){
+		uint64_t n = 0, sink = 0;
+		while (running.load(std::memory_order_relaxed)) {
+			if (write_every && n % write_every == t % write_every) {
+				lock.write_lock();
+				for (uint64_t & v : shared) v++;
+				lock.write_unlock();
+			} else {
+				lock.read_access();
+				for (uint64_t v : shared) sink += v;
+				lock.read_done();
+			}
+			n++;
+		}
+		ops[t] = n + (sink & 0);
+	});
+	std::this_thread::sleep_for(std::chrono::duration<double>(bench_seconds));
+	running.store(false);
+	for (auto & th : ths) th.join();
+	auto span = clk.mark();
+	
+	uint64_t total = 0, least = UINT64_MAX, most = 0;
+	for (uint64_t n : ops) {
+		total += n;
+		least = std::min(least, n);
+		most = std::max(most, n);
+	}
+	aeon::object ret = aeon::map();
+	ret["threads"] = threads;
+	ret["ops_per_sec"] = total / span.sec();
+	ret["fairness"] = most ? static_cast<double>(least) / most : 1.0; // slowest thread's share against the fastest one's
+	return ret;
+}
+
+template <typename L> static aeon::object rw_lock_bench() {
+	aeon::object ret = aeon::map();
+	std::pair<char const *, size_t> mixes [] { {"read_only", 0}, {"read_95", 20}, {"read_50", 2} };
+	for (auto const & mix : mixes) {
+		aeon::object runs = aeon::array();
+		for (size_t t : thread_counts()) runs.array().push_back(rw_run<L>(t, mix.second));
+		ret[mix.first] = std::move(runs);
+	}
+	return ret;
+}
+
+static aeon::object bench_rw() {
+	aeon::object ret = aeon::map();
+	ret["rw_mutex"] = rw_lock_bench<asterales::rw_mutex>();
+	ret["rw_spinlock"] = rw_lock_bench<asterales::rw_spinlock>();
+	ret["legacy_rw_spinlock"] = rw_lock_bench<legacy_rw_spinlock>();
+	ret["std_shared_mutex"] = rw_lock_bench<shared_mutex_rw>();
+	return ret;
+}
+
+// ================================================================================================
+
+// every thread takes the lock, bumps a few shared words and lets go, fairness compares how many times each thread got in
+template <typename L> static aeon::object mutex_run(size_t threads) {
+	L lock;
+	uint64_t shared [8] {};
+	std::atomic_bool running {true};
+	std::vector<uint64_t> ops (threads, 0);
+	std::vector<std::thread> ths;
+	
+	bench_clock clk;
+	clk.mark();
+	for (size_t t = 0; t < threads; t++) ths.emplace_back([&, t](){
+		uint64_t n = 0;
+		while (running.load(std::memory_order_relaxed)) {
+			lock.lock();
+			for (uint64_t & v : shared) v++;
+			lock.unlock();
+			n++;
+		}
+		ops[t] = n;
+	});
+	std::this_thread::sleep_for(std::chrono::duration<double>(bench_seconds));
+	running.store(false);
+	for (auto & th : ths) th.join();
+	auto span = clk.mark();
+	
+	uint64_t total = 0, least = UINT64_MAX, most = 0;
+	for (uint64_t n : ops) {
+		total += n;
+		least = std::min(least, n);
+		most = std::max(most, n);
+	}
+	aeon::object ret = aeon::map();
+	ret["threads"] = threads;
+	ret["ops_per_sec"] = total / span.sec();
+	ret["fairness"] = most ? static_cast<double>(least) / most : 1.0;
+	return ret;
+}
+
+template <typename L> static aeon::object mutex_lock_bench() {
+	aeon::object ret = aeon::array();
+	for (size_t t : thread_counts()) ret.array().push_back(mutex_run<L>(t));
+	return ret;
+}
+
+static aeon::object bench_mutex() {
+	aeon::object ret = aeon::map();
+	ret["fifo_mutex"] = mutex_lock_bench<asterales::fifo_mutex>();
+	ret["fifo_spinlock"] = mutex_lock_bench<asterales::fifo_spinlock>();
+	ret["spinlock"] = mutex_lock_bench<asterales::spinlock>();
+	ret["legacy_spinlock"] = mutex_lock_bench<legacy_spinlock>();
+	ret["std_mutex"] = mutex_lock_bench<std::mutex>();
+	return ret;
+}
+
+// ================================================================================================
+
+int main(int argc, char * * argv) {
+	if (argc < 2 || argc > 4) {
+		printf("usage: %s <mode> [seconds per run] [max threads]\n", argv[0]);
+		return 1;
+	}
+	std::string arg = argv[1];
+	if (argc > 2) bench_seconds = std::stod(argv[2]);
+	if (argc > 3) bench_max_threads = std::max<size_t>(1, std::stoul(argv[3]));
+	
+	aeon::object out = aeon::map();
+	if (arg == "rw" || arg == "all") out["rw"] = bench_rw();
+	if (arg == "mutex" || arg == "all") out["mutex"] = bench_mutex();
+	if (out.map().empty()) {
+		printf("unknown argument: \"%s\"\nmust be one of:\n> all\n> mutex\n> rw\n", arg.c_str());
+		return 1;
+	}
+	printf("%s\n", out.serialize_text().c_str());
+	return 0;
+}
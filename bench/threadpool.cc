@@ -0,0 +1,170 @@
+#include "asterales/aeon.hh"
+#include "asterales/threadpool.hh"
+#include "asterales/time.hh"
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace aeon = asterales::aeon;
+
+typedef asterales::time::keeper<asterales::time::clock_type::monotonic> bench_clock;
+
+static size_t bench_tasks = 1 << 18;
+static size_t bench_threads = std::thread::hardware_concurrency();
+static double bench_timeout = 10;
+
+// the pool as it was before work stealing, one mutex guarded queue and a condition variable wait that can miss its notify
+struct legacy_pool {
+	
+	legacy_pool(size_t pool_size) {
+		for (size_t i = 0; i < pool_size; i++) threads.emplace_back(&legacy_pool::thread_run, this);
+	}
+	
+	~legacy_pool() {
+		run_sem.store(false);
+		queue_cv.notify_all();
+		for (std::thread & th : threads) if (th.joinable()) th.join();
+	}
+	
+	void enqueue(std::unique_ptr<asterales::task_base> && task) {
+		std::unique_lock lk {queue_m};
+		task_queue.push(std::move(task));
+		queue_cv.notify_one();
+	}
+	
+private:
+	
+	std::atomic_bool run_sem {true};
+	std::condition_variable queue_cv;
+	std::mutex queue_m, cv_m;
+	std::vector<std::thread> threads;
+	std::queue<std::unique_ptr<asterales::task_base>> task_queue;
+	
+	void thread_run() {
+		while (run_sem) {
+			{
+				std::unique_lock lk {cv_m};
+				queue_cv.wait_for(lk, std::chrono::milliseconds(5000));
+			}
+			std::unique_lock lk {queue_m};
+			if (task_queue.empty()) continue;
+			auto task = std::move(task_queue.front());
+			task_queue.pop();
+			lk.unlock();
+			task->execute();
+		}
+	}
+};
+
+// ================================================================================================
+
+struct counter_task : public asterales::task_base {
+	counter_task(std::atomic_size_t & c) : done {c} {}
+	std::atomic_size_t & done;
+	virtual void execute() override { done.fetch_add(1, std::memory_order_relaxed); }
+};
+
+// splits into two children until depth runs out, only leaves count, so every spawn after the first comes from inside the pool
+template <typename P> struct spawn_task : public asterales::task_base {
+	spawn_task(P & p, std::atomic_size_t & c, unsigned int d) : pool {p}, done {c}, depth {d} {}
+	P & pool;
+	std::atomic_size_t & done;
+	unsigned int depth;
+	virtual void execute() override {
+		if (!depth) {
+			done.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		pool.enqueue(std::make_unique<spawn_task<P>>(pool, done, depth - 1));
+		pool.enqueue(std::make_unique<spawn_task<P>>(pool, done, depth - 1));
+	}
+};
+
+// the same two workloads through post, with the callable stored inline in the task instead of a heap allocated task_base
+static void post_spawn(asterales::thread_pool & pool, std::atomic_size_t & done, unsigned int depth) {
+	if (!depth) {
+		done.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	pool.post([&pool, &done, depth](){ post_spawn(pool, done, depth - 1); });
+	pool.post([&pool, &done, depth](){ post_spawn(pool, done, depth - 1); });
+}
+
+static unsigned int nested_depth() {
+	unsigned int d = 0;
+	while ((size_t {2} << d) <= bench_tasks) d++;
+	return d;
+}
+
+template <typename P, bool post = false> static aeon::object pool_run(bool nested) {
+	std::atomic_size_t done {0};
+	size_t expected = nested ? size_t {1} << nested_depth() : bench_tasks;
+	
+	bench_clock clk;
+	clk.mark();
+	bool timed_out = false;
+	{
+		P pool {bench_threads};
+		if constexpr (post) {
+			if (nested) pool.post([&pool, &done](){ post_spawn(pool, done, nested_depth()); });
+			else for (size_t i = 0; i < bench_tasks; i++) pool.post([&done](){ done.fetch_add(1, std::memory_order_relaxed); });
+		} else {
+			if (nested) pool.enqueue(std::make_unique<spawn_task<P>>(pool, done, nested_depth()));
+			else for (size_t i = 0; i < bench_tasks; i++) pool.enqueue(std::make_unique<counter_task>(done));
+		}
+		while (done.load() < expected) {
+			if (clk.mark_ghost().sec() > bench_timeout) {
+				timed_out = true;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	}
+	auto span = clk.mark();
+	
+	aeon::object ret = aeon::map();
+	ret["threads"] = bench_threads;
+	ret["tasks"] = expected;
+	ret["completed"] = done.load();
+	ret["seconds"] = span.sec();
+	ret["tasks_per_sec"] = done.load() / span.sec();
+	if (timed_out) ret["timed_out"] = true;
+	return ret;
+}
+
+template <typename P, bool post = false> static aeon::object pool_bench(std::string const & arg) {
+	aeon::object ret = aeon::map();
+	if (arg == "flat" || arg == "all") ret["flat"] = pool_run<P, post>(false);
+	if (arg == "nested" || arg == "all") ret["nested"] = pool_run<P, post>(true);
+	return ret;
+}
+
+// ================================================================================================
+
+int main(int argc, char * * argv) {
+	if (argc < 2 || argc > 5) {
+		printf("usage: %s <mode> [tasks] [threads] [timeout seconds]\n", argv[0]);
+		return 1;
+	}
+	std::string arg = argv[1];
+	if (argc > 2) bench_tasks = std::stoul(argv[2]);
+	if (argc > 3) bench_threads = std::stoul(argv[3]);
+	if (argc > 4) bench_timeout = std::stod(argv[4]);
+	if (!bench_threads) bench_threads = 1;
+	
+	if (arg != "flat" && arg != "nested" && arg != "all") {
+		printf("unknown argument: \"%s\"\nmust be one of:\n> all\n> flat\n> nested\n", arg.c_str());
+		return 1;
+	}
+	aeon::object out = aeon::map();
+	out["work_stealing"] = pool_bench<asterales::thread_pool>(arg);
+	out["work_stealing_post"] = pool_bench<asterales::thread_pool, true>(arg);
+	out["legacy"] = pool_bench<legacy_pool>(arg);
+	printf("%s\n", out.serialize_text().c_str());
+	return 0;
+}
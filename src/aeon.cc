@@ -801,9 +801,9 @@ static size_t read_varuint(buffer_assembly & buf) {
 
 static aeon::str_t parse_aeon_binary_string(buffer_assembly & buf) {
 	size_t len = read_varuint(buf);
+	ncheck(len);
 	std::string str;
 	str.resize(len);
-	ncheck(len);
 	buf.read_many(str.data(), len);
 	return str;
 }
@@ -29,6 +29,7 @@ namespace asterales {
 		inline byte_t const * data () const { return offset_; }
 		inline size_t size() const { return size_; }
 		inline size_t capacity() const { return reserve_size_; }
+		inline size_t spare() const { return reserve_size_ - (offset_ - data_) - size_; } // writable bytes past the end
 		
 		void realign();
 		void reserve(size_t size);
@@ -36,6 +37,9 @@ namespace asterales {
 		void shrink(); // shrink to fit
 		void clear();
 		
+		byte_t * prepare(size_t size); // make at least <size> bytes writable past the end, returns a pointer to them, size is unchanged
+		inline void commit(size_t size) { size_ += size; } // append <size> bytes previously written through prepare
+		
 		inline byte_t & at(size_t index) noexcept { return offset_[index]; }
 		inline byte_t const & at(size_t index) const noexcept { return offset_[index]; }
 		inline byte_t & operator [] (size_t index) noexcept { return offset_[index]; }
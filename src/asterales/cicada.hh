@@ -1,13 +1,18 @@
 #pragma once
 
+#include "aeon.hh"
 #include "buffer_assembly.hh"
 #include "synchro.hh"
 #include "time.hh"
+#include "topology.hh"
 
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <forward_list>
 #include <functional>
+#include <initializer_list>
+#include <map>
 #include <memory>
 #include <queue>
 #include <thread>
@@ -16,6 +21,7 @@
 #include <stdexcept>
 
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 namespace asterales::cicada {
 	
@@ -25,6 +31,8 @@ namespace asterales::cicada {
 	namespace exception {
 		struct base {};
 		struct connection_resolve : public base {};
+		struct fiber_stack : public base {};
+		struct fiber_cancel : public base {}; // unwinds a suspended fiber whose connection is being destroyed, must not be swallowed
 		struct connection_establish : public base {};
 		struct socket_acquire : public base {};
 		struct socket_bind : public base {};
@@ -49,8 +57,15 @@ namespace asterales::cicada {
 	
 	struct sendfile_helper {
 		sendfile_helper(std::string const & path, off_t offset, size_t count);
+		sendfile_helper(sendfile_helper &&);
+		~sendfile_helper();
 		bool is_done();
-		ssize_t work(connection &);
+		ssize_t work(connection &); // sends until done or the socket would block
+		
+		// descriptors and metadata of served files are cached process-wide, entries are re-stat'd at most once per <revalidate> and closed once evicted and no longer in use
+		static void cache_configure(size_t max_open, asterales::time::span revalidate);
+		static void cache_clear();
+		static size_t cache_size();
 	private:
 		struct impl_t;
 		std::unique_ptr<impl_t> impl;
@@ -61,15 +76,51 @@ namespace asterales::cicada {
 		connection(connection const & other) = delete;
 		connection(connection &&);
 		connection(socket &&);
-		virtual ~connection() = default;
+		virtual ~connection();
 		
 		ssize_t read(char * buf, size_t buf_len); // 1:1 recv
-		ssize_t read(buffer_assembly &, size_t cnt = SIZE_MAX); // read up to <cnt> bytes into a byte buffer, appends to end
+		ssize_t readv(struct iovec const * iov, int iovcnt); // 1:1 readv
+		ssize_t read(buffer_assembly &, size_t cnt = SIZE_MAX); // read up to <cnt> bytes directly into a byte buffer's spare capacity, appends to end
 		ssize_t write(char const * buf, size_t buf_len); // 1:1 send
 		ssize_t write(buffer_assembly const &, size_t cnt = SIZE_MAX); // write up to <cnt> bytes, does not modify buffer
 		ssize_t write_consume(buffer_assembly &, size_t cnt = SIZE_MAX); // write up to <cnt> bytes, consumes from beginning
+		ssize_t writev(struct iovec const * iov, int iovcnt, bool more = false); // 1:1 sendmsg, <more> hints that more data follows (MSG_MORE)
+		ssize_t write(std::initializer_list<buffer_assembly const *>, bool more = false); // gather write in one syscall, does not modify buffers
+		ssize_t write_consume(std::initializer_list<buffer_assembly *>, bool more = false); // gather write in one syscall, consumes from the beginning of each buffer in order
 		ssize_t sendfile(int fd, off_t * offs, size_t size); // 1:1 sendfile
 		ssize_t sendfile(sendfile_helper &);
+		ssize_t splice(int pipe_fd, size_t size); // move up to <size> bytes from a pipe to the socket without a userspace copy
+		ssize_t splice(int fd, off_t * offs, size_t size); // same for regular files, staged through a per-connection pipe, <size> is everything not yet delivered
+		inline size_t splice_buffered() const { return splice_staged; } // bytes already read from the file but still waiting in the staging pipe
+		
+		bool zerocopy(); // opt into MSG_ZEROCOPY (SO_ZEROCOPY), false where the socket doesn't support it (e.g. AF_UNIX)
+		ssize_t write_zerocopy(std::shared_ptr<buffer_assembly const> const &, size_t offset = 0); // send from <offset> without copying, the buffer is held until the kernel releases it, a plain copying write unless zerocopy() succeeded
+		size_t reap_zerocopy(); // read completions from the error queue and release finished buffers, returns number of sends completed
+		inline bool zerocopy_pending() const { return !zc_pending.empty(); }
+		inline size_t zerocopy_copied() const { return zc_copied; } // completions where the kernel fell back to copying (e.g. loopback)
+		
+		void queue(buffer_assembly &&); // append to the output queue, nothing is sent until flush
+		void queue(buffer_assembly const &);
+		ssize_t flush(); // gather write as much of the output queue as the socket accepts, the reactor calls this once per turn
+		inline size_t queued() const { return out_size; }
+		
+		bool cork(); // hold back partial frames (TCP_CORK) until uncork
+		bool uncork();
+		
+		bool read_query = false; // size buffer reads with FIONREAD instead of relying on the adaptive hint alone
+		size_t read_hint; // current adaptive read size, grows when reads fill it and shrinks when they don't
+		
+	private:
+		std::deque<buffer_assembly> out_queue;
+		size_t out_size = 0;
+		
+		int splice_pipe [2] {-1, -1};
+		size_t splice_staged = 0;
+		
+		std::deque<std::pair<uint32_t, std::shared_ptr<buffer_assembly const>>> zc_pending;
+		uint32_t zc_next = 0;
+		size_t zc_copied = 0;
+		bool zc_enabled = false;
 	};
 	
 	struct listener : public socket {
@@ -79,7 +130,8 @@ namespace asterales::cicada {
 		listener(listener const &) = delete;
 		listener(listener &&) = delete;
 		listener(uint16_t, accept_cb &&);
-		virtual ~listener() = default;
+		listener(int fd, accept_cb &&); // adopts an already listening descriptor, e.g. one inherited through handoff
+		virtual ~listener(); // closes without shutdown, the listening socket may be shared with another process
 		
 		void accept() noexcept;
 		
@@ -94,10 +146,20 @@ namespace asterales::cicada {
 			static constexpr type read_available = 1 << 0;
 			static constexpr type write_available = 1 << 1;
 			static constexpr type pulse = 1 << 2;
+			static constexpr type error = 1 << 3; // error queue has entries, e.g. zerocopy completions, already reaped before ready
+			static constexpr type wake = 1 << 4; // requested through reactor::wake, implies nothing about the socket
+			static constexpr type drain = 1 << 5; // the reactor is draining, finish up and terminate
 		};
 	
 		struct detail {
 			reason::type ready_reason;
+			bool edge_triggered; // readiness is only reported on change, ready must read or write until the socket would block
+			uint32_t generation; // together with the descriptor identifies this connection to reactor::wake
+		};
+		
+		enum struct trigger_mode {
+			oneshot, // interest is re-armed with one epoll_ctl after every ready
+			edge, // registered once with EPOLLET, epoll_ctl only when the wanted mask changes
 		};
 		
 		struct protocol;
@@ -124,6 +186,16 @@ namespace asterales::cicada {
 			virtual ~protocol() = default;
 			virtual signal ready(connection &, detail const &) = 0;
 			virtual signal::mask::type default_mask() { return signal::mask::wait_for_read | signal::mask::wait_for_write; }
+			virtual void backpressure(bool /*engaged*/) {} // reading from this connection was paused or resumed because of its output queue or the reactor's memory budget
+			// while paused ready is no longer called for read_available, but it still is for writes, wakes, pulses and the like, a protocol that reads then should hold off until resumed
+		};
+		
+		// output queued on connections is accounted per connection and across the reactor, while over the high marks EPOLLIN is dropped and ready isn't called for read_available
+		struct watermarks {
+			size_t low = 1 << 16; // a paused connection resumes reading once its queue is at or below this
+			size_t high = 1 << 20; // a connection stops reading once its queue is above this
+			size_t budget_low = SIZE_MAX; // connections paused by the budget resume once the total is at or below this
+			size_t budget_high = SIZE_MAX; // every connection stops reading while the total is above this, including ones that only queue onto others (e.g. a gateway's upstream side)
 		};
 		
 		reactor(bool create_master_thread = false, unsigned int workers = std::thread::hardware_concurrency());
@@ -135,6 +207,16 @@ namespace asterales::cicada {
 		struct protocol_instantiator {
 			virtual ~protocol_instantiator() = default;
 			virtual std::unique_ptr<protocol> instantiate() = 0;
+			virtual void connect_failed() {} // outbound only, the name did not resolve or no address could be connected to
+		};
+		
+		// outbound names are resolved off the calling thread and cached, every address is then raced with staggered starts
+		struct resolver_config {
+			unsigned int threads = 2;
+			std::chrono::milliseconds ttl {30000}; // getaddrinfo does not report record lifetimes, so every answer is kept this long
+			std::chrono::milliseconds negative_ttl {1000}; // failed lookups are remembered this long
+			std::chrono::milliseconds stagger {250}; // delay before the next address is tried while earlier attempts are still pending
+			std::chrono::milliseconds connect_timeout {10000}; // a connect that no address got through by then fails, counted from the first attempt
 		};
 		
 		typedef std::shared_ptr<protocol_instantiator> protocol_instantiator_ptr;
@@ -145,35 +227,54 @@ namespace asterales::cicada {
 			epoll_register(services[port]->FD);
 			service_lock.unlock();
 		}
+		void adopt(int fd, std::shared_ptr<protocol_instantiator> const & pi); // listen on an inherited listening descriptor
+		std::vector<int> listener_descriptors(); // for handing the listeners to a replacement process
+		bool drain(std::chrono::milliseconds deadline); // stop accepting, ready every connection with reason::drain and wait for all to terminate, false if some outlived the deadline
+		
 		template <typename T> void listen(uint16_t port) { listen(port, std::shared_ptr<automatic_protocol_instantiator<T>> { new automatic_protocol_instantiator<T> {} }); }
 		
+		void set_watermarks(watermarks const & wm_in) { wm = wm_in; } // should be set before any connections are accepted
+		void set_trigger_mode(trigger_mode t) { trigger = t; } // should be set before any connections are accepted
+		void set_resolver_config(resolver_config const &); // connects already started keep the settings they started with
+		void set_pulse_interval(std::chrono::milliseconds i) { pulse_interval = i.count() / 1000.0; }
+		void set_placement(topology::placement const &); // pins workers, across several nodes each connection is then handled on the node its traffic arrives on, may be called while running, earlier connections fall back to the first lane if theirs is gone
+		void set_lock_stats(bool); // count contention on the reactor's own locks and report it in stats(), may be switched while running, a connection only counts if it was accepted while enabled
+		inline size_t queued_total() const { return queued_bytes.load(std::memory_order_relaxed); }
+		
+		aeon::object stats(); // snapshot of counters and latency histograms, workers merge their local counts every few dispatches so it may trail slightly
+		
+		void wake(int fd, uint32_t generation); // calls ready with reason::wake, dropped if the connection is gone
+		void schedule(std::chrono::milliseconds delay, std::function<void()> && fn); // runs fn on the master thread once delay has passed, it must not block
+		
 		void master(std::function<bool()> pred); // when passing false for create_master_thread, an existing thread must act as the master by calling this function, a predicate is passed to be able to stop mastering at any point
 		
 		inline void accept_connection(connection && con, std::shared_ptr<protocol_instantiator> const & pi) {
 			this->accept_connection(std::forward<connection &&>(con), pi->instantiate());
 		}
-		void accept_connection(connection && con, std::unique_ptr<protocol> && pi) {
-			int d = con.FD;
-			instance_lock.write_lock();
-			instances[d] = std::shared_ptr<instance> { new instance { *this, std::forward<connection>(con), std::forward<std::unique_ptr<protocol> &&>(pi) } };
-			instance_lock.write_unlock();
- 		}
+		void accept_connection(connection && con, std::unique_ptr<protocol> && pi);
  		
  		template <typename P> inline void connect(std::string const & host, std::string const & service) {
 			connect(host, service, std::make_unique<automatic_protocol_instantiator<P>>());
 		}
- 		void connect(std::string const & host, std::string const & service, std::shared_ptr<protocol_instantiator> const & pi);
+ 		void connect(std::string const & host, std::string const & service, std::shared_ptr<protocol_instantiator> const & pi); // never blocks, failures are reported through connect_failed
 		
 	private:
 		
 		struct instance {
-			instance(reactor const & parent, connection && con, std::unique_ptr<protocol> && pr);
+			instance(reactor const & parent, connection && con, std::unique_ptr<protocol> && pr, uint32_t generation);
 			~instance();
 			reactor const & parent;
+			uint32_t const generation;
 			connection con;
 			std::unique_ptr<protocol> proto;
 			asterales::spinlock use_lock;
+			size_t accounted = 0; // bytes of this connection's output queue counted in queued_bytes
+			bool throttled = false;
+			bool in_budget_wait = false; // listed in budget_waiters, cleared once the re-evaluation that releases it is dispatched
+			signal::mask::type last_mask = 0;
+			std::atomic<reason::type> pending {0}; // reasons that arrived while another worker held use_lock
 			void * epoll_evt;
+			void add_epoll(); // only once published, so no event can arrive for an instance workers can't find yet
 			void update_epoll(int flags);
 		};
 		
@@ -184,32 +285,188 @@ namespace asterales::cicada {
 		std::unordered_map<uint16_t, std::unique_ptr<listener>> services;
 		asterales::spinlock service_lock;
 		
-		std::unordered_map<int, std::shared_ptr<instance>> instances;
-		asterales::rw_spinlock instance_lock;
+		// instances are indexed directly by descriptor in lazily allocated chunks of slots, dispatch never locks the table
+		// each publication bumps the slot generation so events queued for a previous owner of a reused descriptor are dropped
+		struct instance_slot {
+			std::atomic<instance *> inst {nullptr};
+			std::atomic_uint32_t generation {0};
+			std::atomic_uint32_t lane {0}; // queue its events go to, set on publication
+		};
+		static constexpr int slot_chunk_bits = 10;
+		std::unique_ptr<std::atomic<instance_slot *>[]> slot_chunks;
+		size_t slot_chunks_num;
+		std::atomic_int slot_high {-1};
+		instance_slot * slot_find(int fd) const;
+		instance_slot * slot_acquire(int fd);
+		
+		// removed instances are freed once every worker has left the epoch it could have found them in
+		std::atomic_uint64_t epoch {1};
+		std::unique_ptr<std::atomic_uint64_t[]> worker_epochs; // 0 while the worker is outside of dispatch
+		std::vector<std::pair<uint64_t, instance *>> retired;
+		asterales::spinlock retire_lock;
+		void retire(instance_slot *, instance *);
+		void reclaim();
+		
+		trigger_mode trigger = trigger_mode::oneshot;
+		
+		struct stats_t;
+		struct worker_stats;
+		std::unique_ptr<stats_t> stats_data;
+		
+		watermarks wm;
+		std::atomic_size_t queued_bytes {0};
+		std::vector<std::pair<int, uint32_t>> budget_waiters; // paused only by the budget, woken once it is released
+		asterales::spinlock budget_lock;
+		bool apply_backpressure(instance *);
+		void release_budget();
+		
+		struct resolver_t;
+		struct connect_group;
+		struct connect_protocol;
+		std::unique_ptr<resolver_t> resolver;
+		
+		std::multimap<uint64_t, std::function<void()>> timers; // keyed by monotonic deadline in nanoseconds
+		asterales::spinlock timer_lock;
+		int timer_fd;
+		void run_timers();
 		
 		std::atomic_bool run_sem {true};
 		std::thread * master_thread = nullptr;
 		std::vector<std::thread *> workers;
 		
 		struct m2w_msg {
-			inline m2w_msg(int d_, reason::type r_) : descriptor {d_}, r {r_} {}
+			inline m2w_msg(int d_, uint32_t g_, reason::type r_, uint64_t s_) : descriptor {d_}, generation {g_}, r {r_}, stamp {s_} {}
 			int descriptor;
+			uint32_t generation;
 			reason::type r;
+			uint64_t stamp; // monotonic nanoseconds when the master woke up for this message
 		};
 		
-		std::queue<m2w_msg> m2w_queue;
+		// one queue per NUMA node that has workers, workers take from their own node's queue and only fall back to the others when it is empty
+		std::vector<std::queue<m2w_msg>> m2w_lanes;
+		std::vector<uint32_t> node_lane; // lane of each topology node, UINT32_MAX for nodes without workers, with m2w_lock held
+		std::unique_ptr<std::atomic_uint32_t[]> worker_lane;
+		std::atomic_uint32_t lane_rr {0};
+		uint32_t pick_lane(int fd);
+		inline void m2w_push(int fd, uint32_t generation, reason::type r, uint64_t stamp) { // with m2w_lock held
+			instance_slot * slot = m2w_lanes.size() > 1 ? slot_find(fd) : nullptr;
+			uint32_t lane = slot ? slot->lane.load(std::memory_order_relaxed) : 0;
+			m2w_lanes[lane < m2w_lanes.size() ? lane : 0].emplace(fd, generation, r, stamp);
+		}
+		size_t m2w_depth() const;
 		asterales::spinlock m2w_lock;
 		std::condition_variable m2w_cv;
 		std::mutex m2w_cv_mut;
 		
 		asterales::time::point last_pulse;
+		asterales::time::span pulse_interval {5};
 		
 		int epoll_obj;
 		void * epoll_mevt;
+		size_t epoll_mevt_size = 128;
+		size_t epoll_lull = 0;
 		void epoll_register(int fd);
 		
 		void master_loop();
-		void worker_run();
+		void worker_run(unsigned int index);
+		bool dispatch(instance_slot *, instance *, reason::type, uint64_t stamp, worker_stats &); // called with use_lock held and releases it, false once the instance was retired
+	};
+	
+	// keeps established outbound connections attached to a reactor per host:service, acquire hands one to a fresh protocol through switch_protocols
+	// a pooled protocol gives its connection back by switching to checkin(), switching to anything else takes it out of the pool
+	struct connection_pool {
+		struct config {
+			size_t max_idle = 8; // per host, connections checked in beyond this are closed
+			size_t max_per_host = 64; // connecting, leased and idle together, further acquires wait for a connection to come back
+			std::chrono::milliseconds idle_timeout {60000};
+			std::function<bool(connection &)> health_check; // run on idle connections every reactor pulse, false closes the connection, must not block
+		};
+		
+		connection_pool(reactor &);
+		connection_pool(reactor &, config const &);
+		connection_pool(connection_pool const &) = delete;
+		~connection_pool(); // idle connections close on their next pulse, waiting acquires get connect_failed
+		
+		void acquire(std::string const & host, std::string const & service, reactor::protocol_instantiator_ptr const & pi);
+		static std::unique_ptr<reactor::protocol> checkin();
+		
+		aeon::object stats() const;
+		
+	private:
+		struct state;
+		struct host_entry;
+		struct idle_conn;
+		struct idle_protocol;
+		struct lease_protocol;
+		struct pool_instantiator;
+		std::shared_ptr<state> st;
+	};
+	
+	// length prefixed binary aeon messages, each frame is its payload size as a LEB128 varint followed by one serialized object
+	// frames are decoded straight out of the receive buffer, frames sent during one ready are queued as one buffer and go out in the reactor's single flush
+	struct framed_protocol : public reactor::protocol {
+		virtual void frame(connection &, aeon::object &&) = 0; // called for every complete frame in arrival order
+		virtual void closed() {} // the peer hung up, an error occurred or a malformed frame arrived
+		
+		void send(aeon::object const &); // only from within frame
+		inline void close() { closing = true; } // stop decoding and terminate once this turn's output is flushed
+		
+		size_t max_frame = 1 << 24; // a larger prefix is treated as malformed
+		
+		virtual reactor::signal ready(connection &, reactor::detail const &) override final;
+		virtual reactor::signal::mask::type default_mask() override { return reactor::signal::mask::wait_for_read; }
+		virtual void backpressure(bool engaged) override { throttled = engaged; } // overrides must call this one
+		
+	private:
+		buffer_assembly in, out;
+		bool closing = false;
+		bool throttled = false; // no reads until the reactor resumes this connection
+	};
+	
+	// hot restart, the running process serves its listening descriptors over a unix socket and its replacement adopts them before the old one drains
+	// both accept from the same kernel queue in the meantime, so no connection is refused during the switch
+	namespace handoff {
+		bool send(int unix_fd, std::vector<int> const & fds); // one SCM_RIGHTS message
+		std::vector<int> receive(int unix_fd);
+		bool serve(std::string const & path, std::vector<int> const & fds, std::chrono::milliseconds timeout); // bind <path>, send to the first process that connects
+		std::vector<int> fetch(std::string const & path, std::chrono::milliseconds timeout); // connect to <path> once it is served, empty on failure
+	}
+	
+	struct fiber_protocol;
+	
+	// blocking style io for fiber_protocol::run, every wait suspends the fiber and hands the wanted mask back to the reactor instead of blocking the worker
+	struct fiber_io {
+		bool read(buffer_assembly &, size_t n); // until the buffer holds at least <n> bytes, false if the peer closed first
+		bool read_some(buffer_assembly &); // until at least one more byte was appended, false once closed
+		bool write(buffer_assembly &&); // queue and wait until the whole output queue has been sent, false on error
+		bool write(buffer_assembly const &);
+		inline connection & conn() { return con; }
+		
+	private:
+		friend struct fiber_protocol;
+		fiber_io(fiber_protocol & p, connection & c) : proto {p}, con {c} {}
+		void wait(reactor::signal::mask::type);
+		fiber_protocol & proto;
+		connection & con;
+	};
+	
+	// runs a handler on its own stack so it can be written as straight line code, the fiber moves between worker threads while suspended
+	// thread local state must not be held across a wait
+	struct fiber_protocol : public reactor::protocol {
+		fiber_protocol(size_t stack_size = 1 << 16); // pages are only committed once touched
+		~fiber_protocol(); // a suspended fiber is resumed with fiber_cancel thrown from its wait so its stack unwinds
+		
+		virtual void run(fiber_io &) = 0; // returning terminates the connection
+		
+		virtual reactor::signal ready(connection &, reactor::detail const &) override final;
+		virtual reactor::signal::mask::type default_mask() override { return reactor::signal::mask::wait_for_read | reactor::signal::mask::wait_for_write; }
+		
+	private:
+		friend struct fiber_io;
+		struct context;
+		std::unique_ptr<context> ctx;
+		void resume();
+		static void trampoline(unsigned int, unsigned int);
 	};
 	
 }
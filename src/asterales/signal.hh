@@ -1,6 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include "asterales/synchro.hh"
 
@@ -18,10 +23,13 @@ struct asterales::observer {
 	std::vector<std::unique_ptr<connection>> connections;
 };
 
+// callbacks are published as immutable snapshots, fire walks whichever snapshot is current without taking any lock, so it can run from many threads at once and callbacks may connect or disconnect, themselves included
+// connect and disconnect copy the snapshot under a writer lock and swap it in, replaced snapshots are freed after a grace period, once every fire that could still see them has returned
+// a fire that already started may still call a callback disconnected meanwhile
 template <typename ... T> struct asterales::signal {
 	using func_t = std::function<void(T ...)>;
 	using id_t = uint16_t;
-	using cb_t = std::pair<id_t, func_t>;
+	using cb_t = std::pair<id_t, std::shared_ptr<func_t const>>;
 	
 	struct shared_data {
 		shared_data(signal * parent) : parent(parent) {}
@@ -45,39 +53,87 @@ template <typename ... T> struct asterales::signal {
 	};
 	
 	signal() = default;
+	signal(signal const &) = delete;
 	~signal() {
 		data->accessor.write_lock();
 		data->parent = nullptr;
 		data->accessor.write_unlock();
+		delete current.load();
+		for (snapshot * old : retired) delete old;
+		for (snapshot * old : grace) delete old;
 	}
 	
 	void connect(observer & ob, func_t f) {
-		mutex.lock();
+		std::lock_guard<asterales::spinlock> lk {writer};
 		id_t id = id_incrementor++;
-		cbs.emplace_back(id, std::move(f));
+		snapshot * next = new snapshot {*current.load(std::memory_order_relaxed)};
+		next->emplace_back(id, std::make_shared<func_t const>(std::move(f)));
+		publish(next);
 		ob.connections.emplace_back(std::make_unique<connection>(id, data));
-		mutex.unlock();
 	}
-		
 	
 	void disconnect(id_t id) {
-		mutex.lock();
-		cbs.erase(std::remove_if(cbs.begin(), cbs.end(), [id](auto const & v){return v.first == id;}));
-		mutex.unlock();
+		std::lock_guard<asterales::spinlock> lk {writer};
+		snapshot const & now = *current.load(std::memory_order_relaxed);
+		snapshot * next = new snapshot;
+		next->reserve(now.size());
+		for (cb_t const & cb : now) if (cb.first != id) next->push_back(cb);
+		publish(next);
 	}
 	
 	void fire(T ... args) {
-		mutex.lock();
-		for (cb_t & cb : cbs) {
-			cb.second(args ...);
+		std::atomic_size_t & active = firing[asterales::thread_slot() % stripes].count[generation.load(std::memory_order_seq_cst) & 1];
+		active.fetch_add(1, std::memory_order_seq_cst);
+		snapshot const * cbs = current.load(std::memory_order_seq_cst);
+		for (cb_t const & cb : *cbs) {
+			(*cb.second)(args ...);
+		}
+		active.fetch_sub(1, std::memory_order_seq_cst);
+		if (pending_reclaim.load(std::memory_order_relaxed) && writer.try_lock()) {
+			reclaim();
+			writer.unlock();
 		}
-		mutex.unlock();
 	}
 	
 private:
 	
-	std::vector<cb_t> cbs;
+	typedef std::vector<cb_t> snapshot;
+	static constexpr size_t stripes = 4;
+	
+	struct alignas(64) stripe {
+		std::atomic_size_t count [2] {}; // by the parity of the generation the fire started in
+	};
+	
+	std::atomic<snapshot *> current {new snapshot};
+	std::atomic_uint32_t generation {0};
+	stripe firing [stripes]; // fires in progress, spread so concurrent fires on different threads don't share a line
+	std::vector<snapshot *> retired, grace; // replaced snapshots, waiting for a grace period to start and waiting for it to end, with the writer lock held
+	std::atomic_bool pending_reclaim {false};
 	id_t id_incrementor = 0;
-	asterales::spinlock mutex;
+	asterales::spinlock writer;
 	std::shared_ptr<shared_data> data = std::make_shared<shared_data>(this);
+	
+	void publish(snapshot * next) { // with the writer lock held
+		retired.push_back(current.exchange(next, std::memory_order_seq_cst));
+		reclaim();
+	}
+	
+	// fires that started before a generation flip only ever count under the old parity, so new fires can't hold a grace period up
+	// a fire counted under a parity after it was seen empty loaded its snapshot after that check, so it only sees what was still published then
+	// a grace period is: the idle parity drains (late fires of the generation before), retired snapshots join the grace list, flip, the parity just left drains
+	bool drained(size_t parity) const {
+		for (stripe const & s : firing) if (s.count[parity].load(std::memory_order_seq_cst)) return false;
+		return true;
+	}
+	
+	void reclaim() { // with the writer lock held
+		while ((!grace.empty() || !retired.empty()) && drained((generation.load(std::memory_order_relaxed) & 1) ^ 1)) {
+			for (snapshot * old : grace) delete old;
+			grace.clear();
+			if (retired.empty()) break;
+			grace.swap(retired);
+			generation.fetch_add(1, std::memory_order_seq_cst);
+		}
+		pending_reclaim.store(!grace.empty() || !retired.empty(), std::memory_order_relaxed);
+	}
 };
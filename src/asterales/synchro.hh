@@ -1,185 +1,334 @@
 #pragma once
 
 #include <atomic>
+#include <climits>
+#include <cerrno>
 #include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <ctime>
 #include <mutex>
 #include <thread>
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 namespace asterales {
 	
-	struct fifo_mutex final {
-		
-		// NOTE -- should be assumed to not work beyond 256 threads
+	// small per thread number handed out round robin, for spreading threads over striped counters
+	inline size_t thread_slot() {
+		static std::atomic_size_t next {0};
+		thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed);
+		return mine;
+	}
+	
+	// raw futex on a 32 bit atomic, wait returns once woken or right away if the word no longer holds <expected>, spurious returns are possible
+	inline void futex_wait(std::atomic_uint32_t & word, uint32_t expected) {
+		syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+	}
+	
+	// false once <timeout> passed without a wake
+	inline bool futex_wait(std::atomic_uint32_t & word, uint32_t expected, std::chrono::nanoseconds timeout) {
+		timespec ts { static_cast<time_t>(timeout.count() / 1000000000), static_cast<long>(timeout.count() % 1000000000) };
+		return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0) == 0 || errno != ETIMEDOUT;
+	}
+	
+	inline void futex_wake(std::atomic_uint32_t & word, int count = 1) {
+		syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+	}
+	
+	// MCS queue lock, waiters line up in arrival order and each spins on its own node, the unlock hands the lock straight to the next in line
+	// nodes come from a per thread cache, so a lock is just two pointers, with <park> a waiter sleeps on a futex in its node after a short spin
+	template <bool park> struct queue_lock {
 		
-		fifo_mutex() = default;
+		queue_lock() = default;
+		queue_lock(queue_lock const &) = delete;
 		
 		inline void lock() {
-			std::unique_lock<std::mutex> lk {mut};
-			uint_fast8_t my_number = ticket_counter++;
-			if (my_number != now_serving) cv.wait(lk, [&](){return my_number != now_serving;});
+			node * me = node_cache::get();
+			node * pred = tail.exchange(me, std::memory_order_acq_rel);
+			if (pred) {
+				pred->next.store(me, std::memory_order_release);
+				for (size_t i = 0; me->state.load(std::memory_order_acquire) != granted; i++) {
+					if (i < 256) {
+						__asm volatile ("pause" ::: "memory");
+						continue;
+					}
+					if (!park) { // the thread ahead may be preempted, spinning out the rest of our slice would only delay it
+						std::this_thread::yield();
+						continue;
+					}
+					uint32_t s = waiting;
+					if (me->state.compare_exchange_strong(s, parked, std::memory_order_acquire) || s == parked) futex_wait(me->state, parked);
+					else std::this_thread::yield(); // being woken, granted follows once the waker is done with the node
+				}
+			}
+			holder = me;
+		}
+		
+		inline bool try_lock() {
+			node * me = node_cache::get();
+			node * expected = nullptr;
+			if (!tail.compare_exchange_strong(expected, me, std::memory_order_acq_rel)) {
+				node_cache::put(me);
+				return false;
+			}
+			holder = me;
+			return true;
 		}
 		
 		inline void unlock() {
-			std::unique_lock<std::mutex> lk {mut};
-			now_serving++;
-			cv.notify_all();
+			node * me = holder;
+			node * next = me->next.load(std::memory_order_acquire);
+			if (!next) {
+				node * expected = me;
+				if (tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+					node_cache::put(me);
+					return;
+				}
+				for (size_t i = 0; !(next = me->next.load(std::memory_order_acquire)); i++) { // a new waiter swapped the tail but hasn't linked itself yet
+					if (i < 256) __asm volatile ("pause" ::: "memory");
+					else std::this_thread::yield();
+				}
+			}
+			// the waiter may take, release and recycle its node as soon as it is granted, so a parked one is woken first and only granted after
+			uint32_t s = waiting;
+			if (!next->state.compare_exchange_strong(s, granted, std::memory_order_release, std::memory_order_relaxed)) {
+				next->state.store(waking, std::memory_order_relaxed);
+				futex_wake(next->state);
+				next->state.store(granted, std::memory_order_release);
+			}
+			node_cache::put(me);
 		}
 		
 	private:
-		std::mutex mut;
-		std::condition_variable cv;
 		
-		std::atomic_uint_fast8_t ticket_counter;
-		std::atomic_uint_fast8_t now_serving;
+		static constexpr uint32_t granted = 0, waiting = 1, parked = 2, waking = 3;
+		
+		struct alignas(64) node {
+			std::atomic<node *> next {nullptr};
+			std::atomic_uint32_t state {waiting};
+			node * free_next = nullptr;
+		};
+		
+		struct node_cache {
+			node * head = nullptr;
+			~node_cache() {
+				while (head) {
+					node * n = head;
+					head = n->free_next;
+					delete n;
+				}
+			}
+			static inline node_cache & local() {
+				thread_local node_cache cache;
+				return cache;
+			}
+			static inline node * get() {
+				node_cache & c = local();
+				node * n = c.head;
+				if (n) c.head = n->free_next;
+				else n = new node;
+				n->next.store(nullptr, std::memory_order_relaxed);
+				n->state.store(waiting, std::memory_order_relaxed);
+				return n;
+			}
+			static inline void put(node * n) {
+				node_cache & c = local();
+				n->free_next = c.head;
+				c.head = n;
+			}
+		};
+		
+		std::atomic<node *> tail {nullptr};
+		node * holder = nullptr; // only touched by the thread holding the lock
+	};
+	
+	// strictly first come first served
+	struct fifo_mutex final : public queue_lock<true> {};
+	struct fifo_spinlock final : public queue_lock<false> {};
+	
+	// contention counters a lock can be pointed at, several locks may share one
+	struct lock_stats {
+		std::atomic_uint64_t acquisitions {0};
+		std::atomic_uint64_t contended {0}; // acquisitions that found the lock taken
+		std::atomic_uint64_t spins {0}; // backoff rounds spent waiting
+		std::atomic_uint64_t parked {0}; // futex waits
 	};
 	
+	// test and test-and-set with exponential backoff, parks on a futex once a bounded spin didn't get it
 	struct spinlock final {
 		
-		inline void lock() { while (accessor.test_and_set()) __asm volatile ("pause" ::: "memory"); }
-		inline bool try_lock() { return !accessor.test_and_set(); }
-		inline void unlock() { accessor.clear(); }
+		spinlock() = default;
+		spinlock(spinlock const &) = delete;
+		
+		inline void lock() {
+			uint32_t s = 0;
+			if (!word.compare_exchange_strong(s, 1, std::memory_order_acquire, std::memory_order_relaxed)) lock_slow();
+			if (lock_stats * ls = stats.load(std::memory_order_relaxed)) ls->acquisitions.fetch_add(1, std::memory_order_relaxed);
+		}
+		
+		inline bool try_lock() {
+			uint32_t s = 0;
+			if (word.load(std::memory_order_relaxed) || !word.compare_exchange_strong(s, 1, std::memory_order_acquire, std::memory_order_relaxed)) return false;
+			if (lock_stats * ls = stats.load(std::memory_order_relaxed)) ls->acquisitions.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+		
+		inline void unlock() {
+			if (word.exchange(0, std::memory_order_release) == 2) futex_wake(word, 1);
+		}
+		
+		inline void set_stats(lock_stats * s) { stats.store(s, std::memory_order_relaxed); } // null stops counting, may change while the lock is in use, the counters must outlive the lock
 		
 	private:
 		
-		std::atomic_flag accessor {false};
+		static constexpr uint32_t spin_rounds = 16, max_backoff = 64;
+		
+		std::atomic_uint32_t word {0}; // 0 free, 1 held, 2 held with somebody parked
+		std::atomic<lock_stats *> stats {nullptr};
+		
+		void lock_slow() {
+			lock_stats * ls = stats.load(std::memory_order_relaxed);
+			if (ls) ls->contended.fetch_add(1, std::memory_order_relaxed);
+			uint32_t backoff = 1, rounds = 0;
+			for (; rounds < spin_rounds; rounds++) {
+				for (uint32_t i = 0; i < backoff; i++) __asm volatile ("pause" ::: "memory");
+				if (backoff < max_backoff) backoff <<= 1;
+				uint32_t s = 0;
+				if (!word.load(std::memory_order_relaxed) && word.compare_exchange_weak(s, 1, std::memory_order_acquire, std::memory_order_relaxed)) break;
+			}
+			if (ls) ls->spins.fetch_add(rounds, std::memory_order_relaxed);
+			if (rounds < spin_rounds) return;
+			// taken as 2 from here on, it can't tell whether other waiters are parked too, so the unlock has to wake one
+			while (word.exchange(2, std::memory_order_acquire)) {
+				if (ls) ls->parked.fetch_add(1, std::memory_order_relaxed);
+				futex_wait(word, 2);
+			}
+		}
 	};
 	
-	struct rw_mutex final {
-
-		rw_mutex() = default;
+	// reader counts are spread over cache line sized stripes so readers on different threads don't share a line, a writer raises one flag that every new reader backs off from
+	// writers are preferred, once one is waiting no reader gets in until it is done, a read access must be finished by the thread that took it
+	// with <park> waiters sleep on futexes after a short spin, without they only spin
+	template <bool park> struct striped_rw_lock {
+		
+		static constexpr size_t stripes = 8;
 		
 		inline void read_access() {
-			accessor.lock();
-			write_sem.lock();
-			write_sem.unlock();
-			readers.fetch_add(1);
-			accessor.unlock();
+			counter & c = stripe();
+			while (true) {
+				c.readers.fetch_add(1, std::memory_order_seq_cst);
+				if (!writer.load(std::memory_order_seq_cst)) return;
+				leave(c);
+				wait_writer();
+			}
 		}
 		
 		inline bool read_access_try() {
-			if (!accessor.try_lock()) return false;
-			if (!write_sem.try_lock()) {
-				accessor.unlock();
-				return false;
-			}
-			write_sem.unlock();
-			readers.fetch_add(1);
-			accessor.unlock();
-			return true;
+			counter & c = stripe();
+			c.readers.fetch_add(1, std::memory_order_seq_cst);
+			if (!writer.load(std::memory_order_seq_cst)) return true;
+			leave(c);
+			return false;
 		}
 		
 		inline void read_done() {
-			if (readers.fetch_add(-1) == 1) rnone_cv.notify_all();
+			leave(stripe());
 		}
 		
 		inline void write_lock() {
-			accessor.lock();
-			write_sem.lock();
-			
-			while (readers) {
-				std::unique_lock<std::mutex> lk {rnone_mut};
-				rnone_cv.wait_for(lk, std::chrono::milliseconds(5));
+			uint32_t w = 0;
+			if (!writer.compare_exchange_strong(w, 1, std::memory_order_seq_cst)) lock_writer_slow();
+			while (true) {
+				uint32_t d = drain.load(std::memory_order_seq_cst);
+				if (!any_readers()) return;
+				if constexpr (park) futex_wait(drain, d);
+				else __asm volatile ("pause" ::: "memory");
 			}
-			
-			accessor.unlock();
 		}
 		
 		inline bool write_lock_try() {
-			if (!accessor.try_lock()) return false;
-			if (!write_sem.try_lock()) {
-				accessor.unlock();
-				return false;
-			}
-			if (readers.load()) {
-				write_sem.unlock();
-				accessor.unlock();
-				return false;
-			}
-			accessor.unlock();
-			return true;
+			uint32_t w = 0;
+			if (!writer.compare_exchange_strong(w, 1, std::memory_order_seq_cst)) return false;
+			if (!any_readers()) return true;
+			write_unlock();
+			return false;
 		}
 		
 		inline void write_unlock() {
-			write_sem.unlock();
+			if (writer.exchange(0, std::memory_order_release) == 2 && park) futex_wake(writer, INT32_MAX);
 		}
 		
-		inline  void write_to_read() {
-			readers.fetch_add(1);
-			write_sem.unlock();
+		inline void write_to_read() {
+			stripe().readers.fetch_add(1, std::memory_order_relaxed);
+			write_unlock();
 		}
 		
 	private:
-		std::atomic_uint_fast8_t readers {0};
-		std::mutex accessor;
-		std::mutex write_sem;
 		
-		std::mutex rnone_mut;
-		std::condition_variable rnone_cv;
-	};
-
-	struct rw_spinlock final {
+		struct alignas(64) counter {
+			std::atomic_uint32_t readers {0};
+		};
 		
-		rw_spinlock() = default;
+		counter counters [stripes];
+		std::atomic_uint32_t writer {0}; // 0 free, 1 held or wanted by a writer, 2 the same with somebody parked on it
+		alignas(64) std::atomic_uint32_t drain {0}; // bumped by readers leaving while a writer waits for them
 		
-		inline void read_access() {
-			while (accessor.test_and_set()) __asm volatile ("pause" ::: "memory");
-			while (write_sem.test_and_set()) __asm volatile ("pause" ::: "memory");
-			write_sem.clear();
-			readers.fetch_add(1);
-			accessor.clear();
-		}
+		inline counter & stripe() { return counters[thread_slot() % stripes]; }
 		
-		inline bool read_access_try() {
-			if (accessor.test_and_set()) return false;
-			if (write_sem.test_and_set()) {
-				accessor.clear();
-				return false;
-			}
-			write_sem.clear();
-			readers.fetch_add(1);
-			accessor.clear();
-			return true;
+		inline bool any_readers() const {
+			for (counter const & c : counters) if (c.readers.load(std::memory_order_seq_cst)) return true;
+			return false;
 		}
 		
-		inline void read_done() {
-			readers.fetch_sub(1);
+		inline void leave(counter & c) {
+			c.readers.fetch_sub(1, std::memory_order_seq_cst);
+			if (writer.load(std::memory_order_seq_cst)) {
+				drain.fetch_add(1, std::memory_order_seq_cst);
+				if constexpr (park) futex_wake(drain, 1);
+			}
 		}
 		
-		inline void write_lock() {
-			while (accessor.test_and_set()) __asm volatile ("pause" ::: "memory");
-			while (write_sem.test_and_set()) __asm volatile ("pause" ::: "memory");
-			while (readers.load()) __asm volatile ("pause" ::: "memory");
-			accessor.clear();
+		// waits for the writer flag to drop, spinning first
+		inline void wait_writer() {
+			for (size_t i = 0; i < 128; i++) {
+				if (!writer.load(std::memory_order_acquire)) return;
+				__asm volatile ("pause" ::: "memory");
+			}
+			if constexpr (park) {
+				uint32_t w = writer.load(std::memory_order_acquire);
+				while (w) {
+					if (w == 2 || writer.compare_exchange_weak(w, 2, std::memory_order_acquire)) futex_wait(writer, 2);
+					w = writer.load(std::memory_order_acquire);
+				}
+			} else while (writer.load(std::memory_order_acquire)) __asm volatile ("pause" ::: "memory");
 		}
 		
-		inline bool write_lock_try() {
-			if (accessor.test_and_set()) return false;
-			if (write_sem.test_and_set()) {
-				accessor.clear();
-				return false;
+		void lock_writer_slow() {
+			uint32_t w;
+			for (size_t i = 0; i < 128; i++) {
+				__asm volatile ("pause" ::: "memory");
+				w = 0;
+				if (writer.compare_exchange_weak(w, 1, std::memory_order_seq_cst)) return;
 			}
-			if (readers.load()) {
-				write_sem.clear();
-				accessor.clear();
-				return false;
+			if constexpr (park) {
+				// once parked it can't tell whether others are too, so it takes the flag as 2 and the unlock wakes everyone
+				w = writer.exchange(2, std::memory_order_seq_cst);
+				while (w) {
+					futex_wait(writer, 2);
+					w = writer.exchange(2, std::memory_order_seq_cst);
+				}
+			} else {
+				do {
+					__asm volatile ("pause" ::: "memory");
+					w = 0;
+				} while (!writer.compare_exchange_weak(w, 1, std::memory_order_seq_cst));
 			}
-			accessor.clear();
-			return true;
 		}
-		
-		inline void write_unlock() {
-			write_sem.clear();
-		}
-		
-		inline void write_to_read() {
-			readers.fetch_add(1);
-			write_sem.clear();
-		}
-		
-	private:
-		std::atomic_uint_fast8_t readers {0};
-		std::atomic_flag accessor {false};
-		std::atomic_flag write_sem {false};
 	};
+	
+	struct rw_mutex final : public striped_rw_lock<true> {};
+	struct rw_spinlock final : public striped_rw_lock<false> {};
 }
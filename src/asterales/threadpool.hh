@@ -1,17 +1,35 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
 #include <condition_variable>
+#include <cstddef>
 #include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
 #include <queue>
 #include <thread>
 #include <vector>
 
+#include "synchro.hh"
+#include "topology.hh"
+
 namespace asterales {
 	
+	namespace exception {
+		struct base {};
+		struct task_dropped : public base {}; // the task's deadline passed or it was cancelled before it started
+	}
+	
 	struct task_base {
+		virtual ~task_base() = default;
 		virtual void execute() = 0;
 	};
 	
@@ -21,8 +39,12 @@ namespace asterales {
 		task_lambda_void(L && lambda) : lambda(std::forward<L &&>(lambda)) {}
 		inline std::future<R> get_future() { return promise.get_future(); }
 		virtual void execute() override {
-			lambda();
-			promise.set_value();
+			try {
+				lambda();
+				promise.set_value();
+			} catch (...) {
+				promise.set_exception(std::current_exception());
+			}
 		}
 	};
 	
@@ -32,7 +54,11 @@ namespace asterales {
 		task_lambda_nvoid(L && lambda) : lambda(std::forward<L &&>(lambda)) {}
 		inline std::future<R> get_future() { return promise.get_future(); }
 		virtual void execute() override {
-			promise.set_value(lambda());
+			try {
+				promise.set_value(lambda());
+			} catch (...) {
+				promise.set_exception(std::current_exception());
+			}
 		}
 	};
 	
@@ -43,25 +69,678 @@ namespace asterales {
 		return std::make_unique<task_lambda_nvoid<R, L>>(std::forward<L &&>(lambda));
 	}
 	
+	// move only type erased callable, anything that fits in inline_size and moves without throwing is stored in place and costs no allocation
+	struct task {
+		static constexpr size_t inline_size = 48;
+		
+		task() = default;
+		template <typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, task>::value>> task(F && f) {
+			typedef std::decay_t<F> T;
+			if constexpr (sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<T>::value) {
+				new (storage) T {std::forward<F>(f)};
+				ops = &inline_ops<T>;
+			} else {
+				*reinterpret_cast<T * *>(storage) = new T {std::forward<F>(f)};
+				ops = &heap_ops<T>;
+			}
+		}
+		task(task const &) = delete;
+		task(task && other) noexcept { take(other); }
+		task & operator = (task && other) noexcept {
+			if (this != &other) {
+				reset();
+				take(other);
+			}
+			return *this;
+		}
+		~task() { reset(); }
+		
+		inline explicit operator bool() const { return ops; }
+		inline void operator () () { ops->invoke(storage); }
+		inline void reset() {
+			if (ops) ops->destroy(storage);
+			ops = nullptr;
+		}
+		
+	private:
+		struct ops_t {
+			void (* invoke) (void *);
+			void (* move) (void * dst, void * src); // leaves src destroyed
+			void (* destroy) (void *);
+		};
+		
+		template <typename T> static constexpr ops_t inline_ops {
+			[](void * p){ (*static_cast<T *>(p))(); },
+			[](void * dst, void * src){ new (dst) T {std::move(*static_cast<T *>(src))}; static_cast<T *>(src)->~T(); },
+			[](void * p){ static_cast<T *>(p)->~T(); },
+		};
+		template <typename T> static constexpr ops_t heap_ops {
+			[](void * p){ (**static_cast<T * *>(p))(); },
+			[](void * dst, void * src){ *static_cast<T * *>(dst) = *static_cast<T * *>(src); },
+			[](void * p){ delete *static_cast<T * *>(p); },
+		};
+		
+		alignas(std::max_align_t) unsigned char storage [inline_size];
+		ops_t const * ops = nullptr;
+		
+		inline void take(task & other) {
+			ops = other.ops;
+			if (ops) ops->move(storage, other.storage);
+			other.ops = nullptr;
+		}
+	};
+	
+	struct thread_pool;
+	
+	// result slot shared by a submitted task and its future, recycled through a freelist per thread and result type instead of going back to the allocator
+	// the shared list only rebalances, a thread that frees more than it allocates hands a batch over and one that runs dry takes a batch back
+	template <typename R> struct task_state {
+		
+		static task_state * acquire() {
+			free_cache & c = free_cache::local();
+			if (!c.head) c.refill();
+			task_state * st = c.head;
+			if (!st) return new task_state;
+			c.head = st->next_free;
+			c.count--;
+			st->refs.store(2, std::memory_order_relaxed);
+			st->status.store(pending, std::memory_order_relaxed);
+			return st;
+		}
+		
+		void release() {
+			if (refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+			value.reset();
+			error = nullptr;
+			free_cache & c = free_cache::local();
+			next_free = c.head;
+			c.head = this;
+			if (++c.count > local_max) c.spill(local_max / 2);
+		}
+		
+		template <typename ... V> void set_value(V && ... v) {
+			value.emplace(std::forward<V>(v) ...);
+			publish();
+		}
+		
+		void set_exception(std::exception_ptr e) {
+			error = e;
+			publish();
+		}
+		
+		inline bool ready() const { return status.load(std::memory_order_acquire) == done; }
+		
+		void wait(); // a pool thread runs other pool work while it waits, and sleeps with another thread covering for it once there is none
+		void on_ready(thread_pool &, task &&); // posts the task once the result is set, right away if it already is
+		
+		std::optional<std::conditional_t<std::is_void<R>::value, bool, R>> value;
+		std::exception_ptr error;
+		
+	private:
+		static constexpr uint32_t pending = 0, waited = 1, done = 2;
+		static constexpr size_t freelist_max = 1024; // shared list, beyond it states are deleted
+		static constexpr size_t local_max = 64; // per thread, half of it moves to the shared list once exceeded
+		
+		std::atomic_uint32_t status {pending}; // futex word, waited means somebody sleeps on it
+		std::atomic_uint32_t refs {2};
+		task_state * next_free = nullptr;
+		
+		spinlock continuation_lock;
+		task continuation; // at most one, futures are move only and attaching one consumes the future
+		thread_pool * continuation_pool = nullptr;
+		
+		static inline spinlock free_lock;
+		static inline task_state * free_head = nullptr;
+		static inline size_t free_count = 0;
+		
+		struct free_cache {
+			task_state * head = nullptr;
+			size_t count = 0;
+			~free_cache() { spill(count); }
+			static inline free_cache & local() {
+				thread_local free_cache cache;
+				return cache;
+			}
+			void refill() { // takes up to half a local list from the shared one
+				std::lock_guard<spinlock> lk {free_lock};
+				for (size_t i = 0; i < local_max / 2 && free_head; i++) {
+					task_state * st = free_head;
+					free_head = st->next_free;
+					free_count--;
+					st->next_free = head;
+					head = st;
+					count++;
+				}
+			}
+			void spill(size_t n) { // moves <n> states to the shared list, deleting what doesn't fit
+				task_state * excess = nullptr;
+				{
+					std::lock_guard<spinlock> lk {free_lock};
+					for (; n && head; n--, count--) {
+						task_state * st = head;
+						head = st->next_free;
+						if (free_count < freelist_max) {
+							st->next_free = free_head;
+							free_head = st;
+							free_count++;
+						} else {
+							st->next_free = excess;
+							excess = st;
+						}
+					}
+				}
+				while (excess) {
+					task_state * st = excess;
+					excess = st->next_free;
+					delete st;
+				}
+			}
+		};
+		
+		void publish();
+		void sleep();
+	};
+	
+	// move only handle on a task_state, get() waits and rethrows whatever the task threw
+	template <typename R> struct task_future {
+		
+		task_future() = default;
+		task_future(task_state<R> * st) : state {st} {}
+		task_future(task_future const &) = delete;
+		task_future(task_future && other) : state {other.state} { other.state = nullptr; }
+		task_future & operator = (task_future && other) {
+			if (this != &other) {
+				if (state) state->release();
+				state = other.state;
+				other.state = nullptr;
+			}
+			return *this;
+		}
+		~task_future() { if (state) state->release(); }
+		
+		inline bool valid() const { return state; }
+		inline bool ready() const { return state->ready(); }
+		inline void wait() const { state->wait(); }
+		
+		R get() {
+			state->wait();
+			task_state<R> * st = state;
+			state = nullptr;
+			std::unique_ptr<task_state<R>, void (*)(task_state<R> *)> hold {st, [](task_state<R> * s){ s->release(); }};
+			if (st->error) std::rethrow_exception(st->error);
+			if constexpr (!std::is_void<R>::value) return std::move(*st->value);
+		}
+		
+		// consumes the future, fn(task_future<R> &&) is posted to the pool with it once it is ready, so get() there never waits
+		template <typename F> void on_ready(thread_pool & pool, F && fn);
+		
+		// consumes the future, fn(R) runs on the pool once the result is in and its result becomes the returned future's
+		// an exception skips fn and goes straight through to the returned future
+		template <typename F> auto then(thread_pool & pool, F && fn);
+		
+	private:
+		task_state<R> * state = nullptr;
+	};
+	
+	// ring of pending tasks behind a spinlock, the owning thread works at the back and everyone else takes from the front
+	// every task carries the steady clock time it was queued at, in nanoseconds
+	struct task_deque {
+		task_deque();
+		task_deque(task_deque const &) = delete;
+		~task_deque(); // destroys tasks that never ran
+		
+		void push_back(task &&, int64_t queued);
+		bool pop_back(task &, int64_t & queued);
+		bool pop_front(task &, int64_t & queued);
+		inline size_t size() const { return count_hint.load(std::memory_order_relaxed); }
+		
+	private:
+		struct entry {
+			task t;
+			int64_t queued;
+		};
+		spinlock lock;
+		entry * ring;
+		size_t capacity, head = 0, count = 0;
+		std::atomic_size_t count_hint {0};
+		void grow();
+	};
+	
+	enum struct priority {
+		interactive,
+		normal,
+		background,
+	};
+	
+	// shared flag, copies cancel together, a default constructed token can never be cancelled
+	struct cancel_token {
+		static cancel_token make() { return cancel_token {std::make_shared<std::atomic_bool>(false)}; }
+		cancel_token() = default;
+		inline void cancel() { if (flag) flag->store(true, std::memory_order_release); }
+		inline bool cancelled() const { return flag && flag->load(std::memory_order_acquire); }
+		inline explicit operator bool() const { return static_cast<bool>(flag); }
+	private:
+		cancel_token(std::shared_ptr<std::atomic_bool> && f) : flag {std::move(f)} {}
+		std::shared_ptr<std::atomic_bool> flag;
+	};
+	
+	struct task_options {
+		typedef std::chrono::steady_clock::time_point time_point;
+		std::optional<priority> lane; // unset takes the lane of the task doing the submitting, normal from outside the pool
+		time_point deadline = time_point::max(); // dropped if it has not started by then
+		cancel_token token; // dropped if cancelled before it started
+	};
+	
+	// work stealing pool, every thread has its own deque that tasks enqueued from inside the pool go to, other submissions go through a shared injection queue
+	// idle threads take from the injection queue, then steal from the front of other threads' deques, spin a little, and only then sleep on a futex
+	// the thread count floats between min and max, growing while every thread is busy and work queues up, and shrinking as threads stay idle
 	struct thread_pool {
 		
 		thread_pool(size_t pool_size = std::thread::hardware_concurrency());
-		~thread_pool();
+		thread_pool(size_t min_threads, size_t max_threads);
+		~thread_pool(); // runs every task still queued before joining
+		
+		static constexpr size_t lanes = 3;
+		
+		struct lane_stats {
+			uint64_t executed = 0; // dequeued tasks, dropped ones included
+			uint64_t dropped = 0;
+			uint64_t wait_total_ns = 0; // time between queueing and starting, summed over executed tasks
+			uint64_t wait_max_ns = 0;
+		};
 		
 		void enqueue(std::unique_ptr<task_base> &&);
 		
+		// fire and forget, nothing is allocated if the callable fits inline in a task, whatever it throws is dropped
+		template <typename F> void post(F && f, task_options const & opt = {}) {
+			if (!droppable(opt)) {
+				push(task {std::forward<F>(f)}, lane_for(opt));
+				return;
+			}
+			priority lane = lane_for(opt);
+			push(task {[this, lane, deadline = opt.deadline, token = opt.token, fn = std::decay_t<F> {std::forward<F>(f)}]() mutable {
+				if (expired(deadline, token)) dropped(lane);
+				else fn();
+			}}, lane);
+		}
+		
+		// like post, but the result or exception comes back through a pooled task_future, a dropped task fails it with exception::task_dropped
+		template <typename F, typename R = std::invoke_result_t<std::decay_t<F> &>> task_future<R> submit(F && f, task_options const & opt = {}) {
+			task_state<R> * st = task_state<R>::acquire();
+			priority lane = lane_for(opt);
+			auto run = [st, fn = std::decay_t<F> {std::forward<F>(f)}]() mutable {
+				try {
+					if constexpr (std::is_void<R>::value) {
+						fn();
+						st->set_value(true);
+					} else st->set_value(fn());
+				} catch (...) {
+					st->set_exception(std::current_exception());
+				}
+				st->release();
+			};
+			if (!droppable(opt)) push(task {std::move(run)}, lane);
+			else push(task {[this, st, lane, deadline = opt.deadline, token = opt.token, run = std::move(run)]() mutable {
+				if (!expired(deadline, token)) {
+					run();
+					return;
+				}
+				dropped(lane);
+				st->set_exception(std::make_exception_ptr(exception::task_dropped {}));
+				st->release();
+			}}, lane);
+			return task_future<R> {st};
+		}
+		
+		lane_stats stats(priority) const;
+		
+		// for a pool thread about to block on something other than pool work, an extra thread covers for it until fn returns
+		template <typename F> decltype(auto) blocking(F && fn) {
+			struct guard_t {
+				thread_pool * pool;
+				~guard_t() { if (pool) pool->end_blocking(); }
+			} guard { begin_blocking() ? this : nullptr };
+			return fn();
+		}
+		
+		bool run_one(); // runs one queued task on the calling thread, so a thread waiting on pool work can help instead of blocking
+		
+		// runs pool work on the calling thread until done() holds, false once nothing turned up for help_window, the wait then depends on something outside the pool and should sleep instead
+		template <typename F> bool help_until(F && done) {
+			std::chrono::steady_clock::time_point since;
+			for (size_t idle = 0; !done(); ) {
+				if (run_one()) idle = 0;
+				else if (++idle < help_spin) __asm volatile ("pause" ::: "memory");
+				else {
+					auto now = std::chrono::steady_clock::now();
+					if (idle == help_spin) since = now;
+					else if (now - since >= help_window) return done();
+					std::this_thread::yield();
+				}
+			}
+			return true;
+		}
+		static thread_pool * current(); // pool the calling thread belongs to, null outside of any
+		
+		void set_placement(topology::placement const &); // pins the pool's threads, threads started later included
+		inline size_t size() const { return live.load(std::memory_order_relaxed); } // threads currently running
+		inline size_t min_size() const { return min_threads; }
+		inline size_t max_size() const { return max_threads; }
+		inline void set_idle_timeout(std::chrono::milliseconds t) { idle_timeout.store(t.count(), std::memory_order_relaxed); } // how long a thread above the minimum stays parked before it retires
+		
 	private:
 		
+		struct worker;
+		struct lane_counters;
+		static thread_local worker * current_worker;
+		static constexpr size_t help_spin = 64;
+		static constexpr std::chrono::microseconds help_window {200};
+		
+		// one slot per thread that may ever run at once, allocated up front so stealing never races with growth, max_threads more than the maximum for blocking compensation
+		std::vector<std::unique_ptr<worker>> workers;
+		std::atomic_size_t slots_used {0}; // slots at or above this never had a thread
+		size_t min_threads, max_threads;
+		std::atomic_size_t live {0};
+		std::atomic_size_t blocked {0};
+		std::atomic_int64_t last_grow {0};
+		std::atomic_int64_t idle_timeout {2000}; // milliseconds
+		std::mutex resize_m;
+		std::unique_ptr<topology::placement> placement;
+		task_deque injection [lanes];
+		std::unique_ptr<lane_counters []> external; // for tasks run by threads outside the pool through run_one
+		
 		std::atomic_bool run_sem {true};
-		std::condition_variable queue_cv;
-		std::mutex queue_m, cv_m;
-		std::vector<std::thread> threads;
+		std::atomic_uint32_t wake_epoch {0}; // futex word, bumped whenever sleepers must recheck for work
+		std::atomic_uint32_t sleepers {0};
+		std::atomic_uint32_t idle {0}; // spinning or parked
+		
+		void push(task &&, priority);
+		void notify();
+		priority lane_for(task_options const &) const;
+		static inline bool droppable(task_options const & opt) { return opt.deadline != task_options::time_point::max() || opt.token; }
+		static bool expired(task_options::time_point deadline, cancel_token const & token);
+		void dropped(priority);
+		
+		// lanes are searched interactive first, except every few picks where a lower lane goes first so it cannot starve
+		bool find_work(worker *, uint32_t & rng, task &, priority & lane, int64_t & queued);
+		bool steal(uint32_t & rng, worker const * self, size_t lane, task &, int64_t & queued);
+		void execute(task &, priority lane, int64_t queued, lane_counters &);
+		void thread_run(worker &);
+		
+		bool spawn(); // starts a thread in a free slot, false if there is none or the pool is shutting down
+		void maybe_grow(int64_t now);
+		bool retire(worker &, bool idle_expired);
+		bool begin_blocking();
+		void end_blocking();
+	};
+	
+	// ================================================================================================
+	
+	template <typename R> void task_state<R>::publish() {
+		task next;
+		{
+			std::lock_guard<spinlock> lk {continuation_lock};
+			if (status.exchange(done, std::memory_order_acq_rel) == waited) futex_wake(status, INT32_MAX);
+			next = std::move(continuation);
+		}
+		if (next) continuation_pool->post(std::move(next));
+	}
+	
+	template <typename R> void task_state<R>::on_ready(thread_pool & pool, task && t) {
+		{
+			std::lock_guard<spinlock> lk {continuation_lock};
+			if (!ready()) {
+				continuation = std::move(t);
+				continuation_pool = &pool;
+				return;
+			}
+		}
+		pool.post(std::move(t));
+	}
+	
+	template <typename R> void task_state<R>::wait() {
+		if (thread_pool * pool = thread_pool::current()) {
+			if (pool->help_until([this](){ return ready(); })) return;
+			pool->blocking([this](){ sleep(); });
+			return;
+		}
+		sleep();
+	}
+	
+	template <typename R> void task_state<R>::sleep() {
+		uint32_t s = status.load(std::memory_order_acquire);
+		while (s != done) {
+			if (s == pending && !status.compare_exchange_weak(s, waited, std::memory_order_acquire)) continue;
+			futex_wait(status, waited);
+			s = status.load(std::memory_order_acquire);
+		}
+	}
+	
+	template <typename R> template <typename F> void task_future<R>::on_ready(thread_pool & pool, F && fn) {
+		task_state<R> * st = state;
+		state = nullptr;
+		st->on_ready(pool, task {[st, fn = std::decay_t<F> {std::forward<F>(fn)}]() mutable {
+			fn(task_future<R> {st});
+		}});
+	}
+	
+	template <typename R> template <typename F> auto task_future<R>::then(thread_pool & pool, F && fn) {
+		typedef std::decay_t<F> Fn;
+		typedef typename std::conditional_t<std::is_void<R>::value, std::invoke_result<Fn &>, std::invoke_result<Fn &, R>>::type R2;
+		task_state<R2> * down = task_state<R2>::acquire();
+		on_ready(pool, [down, fn = Fn {std::forward<F>(fn)}](task_future<R> && up) mutable {
+			try {
+				if constexpr (std::is_void<R>::value) {
+					up.get();
+					if constexpr (std::is_void<R2>::value) {
+						fn();
+						down->set_value(true);
+					} else down->set_value(fn());
+				} else {
+					if constexpr (std::is_void<R2>::value) {
+						fn(up.get());
+						down->set_value(true);
+					} else down->set_value(fn(up.get()));
+				}
+			} catch (...) {
+				down->set_exception(std::current_exception());
+			}
+			down->release();
+		});
+		return task_future<R2> {down};
+	}
+	
+	// ready once every input is, with their results in input order, or the first failure once every input is done
+	template <typename R> auto when_all(thread_pool & pool, std::vector<task_future<R>> && futures) {
+		typedef std::conditional_t<std::is_void<R>::value, void, std::vector<R>> out_t;
+		struct join_t {
+			std::atomic_size_t remaining;
+			std::vector<std::optional<std::conditional_t<std::is_void<R>::value, bool, R>>> values;
+			spinlock error_lock;
+			std::exception_ptr error;
+			task_state<out_t> * out;
+		};
+		task_state<out_t> * out = task_state<out_t>::acquire();
+		if (futures.empty()) {
+			if constexpr (std::is_void<R>::value) out->set_value(true);
+			else out->set_value();
+			out->release();
+			return task_future<out_t> {out};
+		}
+		join_t * join = new join_t {{futures.size()}, {}, {}, {}, out};
+		join->values.resize(futures.size());
+		for (size_t i = 0; i < futures.size(); i++) futures[i].on_ready(pool, [join, i](task_future<R> && f){
+			try {
+				if constexpr (std::is_void<R>::value) {
+					f.get();
+					join->values[i] = true;
+				} else join->values[i] = f.get();
+			} catch (...) {
+				std::lock_guard<spinlock> lk {join->error_lock};
+				if (!join->error) join->error = std::current_exception();
+			}
+			if (join->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+			if (join->error) join->out->set_exception(join->error);
+			else if constexpr (std::is_void<R>::value) join->out->set_value(true);
+			else {
+				std::vector<R> ret;
+				ret.reserve(join->values.size());
+				for (auto & v : join->values) ret.push_back(std::move(*v));
+				join->out->set_value(std::move(ret));
+			}
+			join->out->release();
+			delete join;
+		});
+		return task_future<out_t> {out};
+	}
+	
+	// ready once the first input is, with its index and result, or its exception, the other inputs still run to completion
+	template <typename R> auto when_any(thread_pool & pool, std::vector<task_future<R>> && futures) {
+		typedef std::conditional_t<std::is_void<R>::value, size_t, std::pair<size_t, R>> out_t;
+		struct race_t {
+			std::atomic_size_t remaining;
+			std::atomic_bool won {false};
+			task_state<out_t> * out;
+		};
+		task_state<out_t> * out = task_state<out_t>::acquire();
+		if (futures.empty()) {
+			out->set_exception(std::make_exception_ptr(std::invalid_argument {"when_any of nothing"}));
+			out->release();
+			return task_future<out_t> {out};
+		}
+		race_t * race = new race_t {{futures.size()}, {false}, out};
+		for (size_t i = 0; i < futures.size(); i++) futures[i].on_ready(pool, [race, i](task_future<R> && f){
+			if (!race->won.exchange(true)) {
+				try {
+					if constexpr (std::is_void<R>::value) {
+						f.get();
+						race->out->set_value(i);
+					} else race->out->set_value(i, f.get());
+				} catch (...) {
+					race->out->set_exception(std::current_exception());
+				}
+				race->out->release();
+			}
+			if (race->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) delete race;
+		});
+		return task_future<out_t> {out};
+	}
+	
+	// explicit dependency graph, a node is posted once every node that precedes it has finished
+	// a failing node fails the run, nodes that did not start yet are skipped
+	struct task_graph {
+		typedef size_t node;
+		
+		node add(task &&); // the task runs once per run()
+		void precede(node before, node after);
+		inline size_t size() const { return nodes.size(); }
+		
+		// the graph must be acyclic, outlive the returned future and stay unchanged until it is ready
+		task_future<void> run(thread_pool &);
+		
+	private:
+		struct node_t {
+			task fn;
+			std::vector<node> successors;
+			size_t predecessors = 0;
+			std::atomic_size_t waiting {0};
+		};
+		std::vector<std::unique_ptr<node_t>> nodes;
 		
-		std::queue<std::unique_ptr<task_base>> task_queue;
+		std::atomic_size_t remaining {0};
+		std::atomic_bool failed {false};
+		std::exception_ptr error;
+		spinlock error_lock;
+		task_state<void> * out = nullptr;
 		
-		void thread_run();
+		void run_node(thread_pool &, node);
 	};
 	
+	// ================================================================================================
 	
+	// outstanding count for a set of posted subtasks, the joining thread runs pool work until it reaches zero
+	struct fork_join {
+		std::atomic_bool failed {false};
+		
+		inline void fork() { pending.fetch_add(1, std::memory_order_relaxed); } // before posting a subtask
+		void finish(); // at the end of every forked subtask
+		void fail(std::exception_ptr);
+		void join(thread_pool &); // rethrows the first exception any subtask threw
+		
+	private:
+		static constexpr uint32_t parked = 1u << 31;
+		std::atomic_uint32_t pending {0}; // futex word, subtasks not yet finished with the top bit set while join sleeps
+		spinlock error_lock;
+		std::exception_ptr error;
+	};
+	
+	// runs fn(chunk) for every chunk in [lo, hi), halving the range and posting the upper half until one chunk is left for the current thread
+	// subtasks split further as they get stolen, so nested parallel calls stay balanced
+	template <typename F> void parallel_chunks(thread_pool & pool, fork_join & fj, size_t lo, size_t hi, F & fn) {
+		while (hi - lo > 1) {
+			size_t mid = lo + (hi - lo) / 2;
+			fj.fork();
+			pool.post([&pool, &fj, &fn, mid, hi](){
+				try {
+					parallel_chunks(pool, fj, mid, hi, fn);
+				} catch (...) {
+					fj.fail(std::current_exception());
+				}
+				fj.finish();
+			});
+			hi = mid;
+		}
+		if (lo < hi && !fj.failed.load(std::memory_order_relaxed)) fn(lo);
+	}
+	
+	// number of chunks for n items, a grain of 0 picks a few chunks per pool thread so stealing can even out uneven items
+	inline size_t parallel_chunk_count(thread_pool & pool, size_t n, size_t grain) {
+		if (!n) return 0;
+		if (!grain) grain = std::max<size_t>(1, n / (pool.size() * 4));
+		return (n + grain - 1) / grain;
+	}
+	
+	template <typename F> void parallel_run(thread_pool & pool, size_t chunks, F && fn) {
+		fork_join fj;
+		try {
+			parallel_chunks(pool, fj, 0, chunks, fn);
+		} catch (...) {
+			fj.fail(std::current_exception());
+		}
+		fj.join(pool);
+	}
+	
+	// calls fn(i) for every i in [begin, end), grain is the number of indices per chunk
+	template <typename I, typename F> void parallel_for(thread_pool & pool, I begin, I end, size_t grain, F && fn) {
+		if (!(begin < end)) return;
+		size_t n = static_cast<size_t>(end - begin);
+		size_t chunks = parallel_chunk_count(pool, n, grain);
+		parallel_run(pool, chunks, [&](size_t c){
+			I lo = begin + static_cast<I>(c * n / chunks), hi = begin + static_cast<I>((c + 1) * n / chunks);
+			for (I i = lo; i < hi; i++) fn(i);
+		});
+	}
+	
+	// folds fn(acc, i) over [begin, end) starting from identity in every chunk, then combines the chunk results in index order
+	template <typename I, typename T, typename F, typename C> T parallel_reduce(thread_pool & pool, I begin, I end, size_t grain, T identity, F && fn, C && combine) {
+		if (!(begin < end)) return identity;
+		size_t n = static_cast<size_t>(end - begin);
+		size_t chunks = parallel_chunk_count(pool, n, grain);
+		std::vector<T> partial (chunks, identity);
+		parallel_run(pool, chunks, [&](size_t c){
+			I lo = begin + static_cast<I>(c * n / chunks), hi = begin + static_cast<I>((c + 1) * n / chunks);
+			T acc = identity;
+			for (I i = lo; i < hi; i++) acc = fn(std::move(acc), i);
+			partial[c] = std::move(acc);
+		});
+		T ret = std::move(partial[0]);
+		for (size_t c = 1; c < chunks; c++) ret = combine(std::move(ret), std::move(partial[c]));
+		return ret;
+	}
+	
+	// out[i] = fn(first[i]) for random access iterators
+	template <typename In, typename Out, typename F> void parallel_transform(thread_pool & pool, In first, In last, Out out, size_t grain, F && fn) {
+		parallel_for(pool, size_t {0}, static_cast<size_t>(last - first), grain, [&](size_t i){ out[i] = fn(first[i]); });
+	}
 	
 }
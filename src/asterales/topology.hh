@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace asterales::topology {
+
+	inline constexpr size_t npos = static_cast<size_t>(-1);
+
+	struct cpu {
+		unsigned int id;
+		unsigned int core; // core_id, shared by SMT siblings of one package
+		unsigned int package;
+		unsigned int node;
+	};
+	
+	struct node {
+		unsigned int id;
+		std::vector<unsigned int> cpus;
+	};
+	
+	struct machine {
+		std::vector<cpu> cpus; // only cpus this process may run on, ascending by id
+		std::vector<node> nodes; // only nodes with at least one of those cpus
+		
+		cpu const * find(unsigned int id) const;
+		size_t node_index(unsigned int node_id) const; // position in nodes, npos if unknown
+	};
+	
+	machine const & get(); // read once from /sys/devices/system, a single node of the allowed cpus if that fails
+	
+	std::vector<unsigned int> parse_list(std::string const &); // kernel cpu list format, e.g. "0-3,8,10-11"
+	
+	bool pin(std::thread &, std::vector<unsigned int> const & cpus);
+	bool pin_self(std::vector<unsigned int> const & cpus);
+	
+	// decides which cpus each of a set of threads may run on
+	struct placement {
+		enum struct policy {
+			none, // leave placement to the scheduler
+			compact, // one cpu per thread, filling a node before the next, one SMT sibling per core before the second
+			scatter, // one cpu per thread, round robin across nodes
+			node, // every cpu of one node per thread, round robin across nodes
+		};
+		
+		policy p = policy::none;
+		std::vector<unsigned int> cpus; // restrict to these, empty for every allowed cpu
+		
+		struct slot {
+			std::vector<unsigned int> cpus; // empty for no pinning
+			size_t node = npos; // index into machine::nodes, npos without pinning
+		};
+		
+		std::vector<unsigned int> assign(size_t index) const; // cpus for thread <index>, empty for no pinning
+		size_t node_of(size_t index) const; // node index thread <index> runs on, npos without pinning
+		std::vector<slot> plan(size_t threads) const; // assign and node_of for threads 0 to <threads>, the cpus are only ranked once
+		size_t nodes_used() const;
+	};
+
+}
@@ -79,6 +79,14 @@ void buffer_assembly::shrink() {
 	offset_ = data_ = datap(realloc(data_, reserve_size_));
 }
 
+buffer_assembly::byte_t * buffer_assembly::prepare(size_t size) {
+	if (spare() < size) {
+		if (reserve_size_ - size_ >= size) realign();
+		else reserve(size_ + size > reserve_size_ * 2 ? size_ + size : reserve_size_ * 2);
+	}
+	return offset_ + size_;
+}
+
 void buffer_assembly::clear() {
 	offset_ = data_;
 	size_ = 0;
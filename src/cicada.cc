@@ -1,6 +1,10 @@
 #include "asterales/cicada.hh"
 
 #include <algorithm>
+#include <cstring>
+#include <list>
+#include <new>
+#include <unordered_map>
 
 #include <unistd.h>
 #include <sys/socket.h>
@@ -11,20 +15,274 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
 
 using namespace asterales::cicada;
 
 static constexpr int enable = 1;
 static constexpr int disable = 0;
 
-#define TMPBUF_SIZE 512
+#define READ_HINT_MIN 2048
+#define READ_HINT_MAX (1 << 20)
+#define READ_OVERFLOW_SIZE 65536
+#define WRITE_IOV_MAX 64
 
 #define EPOLLEVT reinterpret_cast<epoll_event *>(epoll_evt)
 
-#define MAX_EPOLL_EVENTS 128
+#define MIN_EPOLL_EVENTS 128
+#define MAX_EPOLL_EVENTS 8192
+#define EPOLL_SHRINK_TURNS 64
 #define EPOLLMEVT reinterpret_cast<epoll_event *>(epoll_mevt)
 
+#define REASON_REEVALUATE (1 << 7) // internal, re-arms an instance for backpressure changes without calling ready
+
+#define SLOT_CHUNK_SIZE (1 << slot_chunk_bits)
+#define SLOT_MAX_FDS (1 << 22)
+#define EPOLL_DATA(fd, gen) ((static_cast<uint64_t>(gen) << 32) | static_cast<uint32_t>(fd))
+
+#define RESOLVER_CACHE_PRUNE 1024 // expired answers are swept once the cache holds this many names
+
+// ================================================================================================
+// STATS
+
+// socket io is counted per thread without any atomics, reactor workers fold their own thread's counts into the reactor totals when they merge
+static thread_local struct io_counters {
+	uint64_t bytes_in = 0, bytes_out = 0;
+	uint64_t read_calls = 0, read_eagain = 0;
+	uint64_t write_calls = 0, write_eagain = 0;
+} io_local;
+
+static inline ssize_t count_in(ssize_t e) {
+	io_local.read_calls++;
+	if (e > 0) io_local.bytes_in += e;
+	else if (e < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) io_local.read_eagain++;
+	return e;
+}
+
+static inline ssize_t count_out(ssize_t e) {
+	io_local.write_calls++;
+	if (e > 0) io_local.bytes_out += e;
+	else if (e < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) io_local.write_eagain++;
+	return e;
+}
+
+static inline uint64_t mono_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * NANO + ts.tv_nsec;
+}
+
+#define HISTOGRAM_BUCKETS 40 // bucket i counts samples in [2^i, 2^(i+1)) nanoseconds
+#define STATS_MERGE_INTERVAL 64
+
+static inline size_t histogram_bucket(uint64_t ns) {
+	size_t b = ns ? 63 - __builtin_clzll(ns) : 0;
+	return b < HISTOGRAM_BUCKETS ? b : HISTOGRAM_BUCKETS - 1;
+}
+
+struct reactor::stats_t {
+	std::atomic_uint64_t accepted {0}, closed {0};
+	std::atomic_uint64_t ev_read {0}, ev_write {0}, ev_pulse {0}, ev_error {0}, dispatched {0};
+	std::atomic_uint64_t queue_max {0};
+	std::atomic_uint64_t resolve_hits {0}, resolve_lookups {0}, connect_attempts {0}, connect_failed {0};
+	std::atomic_uint64_t bytes_in {0}, bytes_out {0};
+	std::atomic_uint64_t read_calls {0}, read_eagain {0}, write_calls {0}, write_eagain {0};
+	std::atomic_uint64_t wakeup_to_ready [HISTOGRAM_BUCKETS] {};
+	std::atomic_uint64_t ready_duration [HISTOGRAM_BUCKETS] {};
+	std::atomic_bool locks_counted {false};
+	asterales::lock_stats lock_m2w, lock_service, lock_retire, lock_budget, lock_timer, lock_instances; // every connection's use_lock counts into lock_instances
+};
+
+struct reactor::worker_stats {
+	uint64_t dispatched = 0;
+	uint64_t wakeup_to_ready [HISTOGRAM_BUCKETS] {};
+	uint64_t ready_duration [HISTOGRAM_BUCKETS] {};
+	
+	void merge(stats_t & into) {
+		into.dispatched.fetch_add(dispatched, std::memory_order_relaxed);
+		dispatched = 0;
+		for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+			if (wakeup_to_ready[i]) into.wakeup_to_ready[i].fetch_add(wakeup_to_ready[i], std::memory_order_relaxed);
+			if (ready_duration[i]) into.ready_duration[i].fetch_add(ready_duration[i], std::memory_order_relaxed);
+			wakeup_to_ready[i] = ready_duration[i] = 0;
+		}
+		into.bytes_in.fetch_add(io_local.bytes_in, std::memory_order_relaxed);
+		into.bytes_out.fetch_add(io_local.bytes_out, std::memory_order_relaxed);
+		into.read_calls.fetch_add(io_local.read_calls, std::memory_order_relaxed);
+		into.read_eagain.fetch_add(io_local.read_eagain, std::memory_order_relaxed);
+		into.write_calls.fetch_add(io_local.write_calls, std::memory_order_relaxed);
+		into.write_eagain.fetch_add(io_local.write_eagain, std::memory_order_relaxed);
+		io_local = {};
+	}
+};
+
+static asterales::aeon::object histogram_object(std::atomic_uint64_t const * buckets) {
+	uint64_t counts [HISTOGRAM_BUCKETS];
+	uint64_t total = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) total += counts[i] = buckets[i].load(std::memory_order_relaxed);
+	asterales::aeon::object ret = asterales::aeon::map();
+	ret["count"] = total;
+	asterales::aeon::object ary = asterales::aeon::array();
+	size_t last = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) if (counts[i]) last = i;
+	for (size_t i = 0; i <= last && total; i++) ary.array().emplace_back(counts[i]);
+	ret["log2_ns_buckets"] = std::move(ary);
+	// percentiles are reported as the upper bound of the bucket they fall in
+	auto percentile = [&](double p) -> uint64_t {
+		uint64_t target = total * p, seen = 0;
+		for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+			seen += counts[i];
+			if (seen > target) return uint64_t {2} << i;
+		}
+		return 0;
+	};
+	ret["p50_ns"] = percentile(0.5);
+	ret["p99_ns"] = percentile(0.99);
+	ret["p999_ns"] = percentile(0.999);
+	return ret;
+}
+
+asterales::aeon::object reactor::stats() {
+	namespace aeon = asterales::aeon;
+	stats_t & s = *stats_data;
+	aeon::object ret = aeon::map();
+	
+	aeon::object & conns = ret["connections"] = aeon::map();
+	uint64_t accepted = s.accepted.load(std::memory_order_relaxed), closed = s.closed.load(std::memory_order_relaxed);
+	conns["accepted"] = accepted;
+	conns["closed"] = closed;
+	conns["open"] = accepted - closed;
+	
+	aeon::object & events = ret["events"] = aeon::map();
+	events["read_available"] = s.ev_read.load(std::memory_order_relaxed);
+	events["write_available"] = s.ev_write.load(std::memory_order_relaxed);
+	events["pulse"] = s.ev_pulse.load(std::memory_order_relaxed);
+	events["error"] = s.ev_error.load(std::memory_order_relaxed);
+	events["dispatched"] = s.dispatched.load(std::memory_order_relaxed);
+	
+	aeon::object & queue = ret["queue"] = aeon::map();
+	m2w_lock.lock();
+	queue["depth"] = m2w_depth();
+	m2w_lock.unlock();
+	queue["max_depth"] = s.queue_max.load(std::memory_order_relaxed);
+	queue["output_bytes"] = queued_total();
+	
+	aeon::object & io = ret["io"] = aeon::map();
+	io["bytes_in"] = s.bytes_in.load(std::memory_order_relaxed);
+	io["bytes_out"] = s.bytes_out.load(std::memory_order_relaxed);
+	io["read_calls"] = s.read_calls.load(std::memory_order_relaxed);
+	io["read_eagain"] = s.read_eagain.load(std::memory_order_relaxed);
+	io["write_calls"] = s.write_calls.load(std::memory_order_relaxed);
+	io["write_eagain"] = s.write_eagain.load(std::memory_order_relaxed);
+	
+	aeon::object & outbound = ret["outbound"] = aeon::map();
+	outbound["resolve_cache_hits"] = s.resolve_hits.load(std::memory_order_relaxed);
+	outbound["resolve_lookups"] = s.resolve_lookups.load(std::memory_order_relaxed);
+	outbound["connect_attempts"] = s.connect_attempts.load(std::memory_order_relaxed);
+	outbound["connect_failed"] = s.connect_failed.load(std::memory_order_relaxed);
+	
+	ret["wakeup_to_ready"] = histogram_object(s.wakeup_to_ready);
+	ret["ready_duration"] = histogram_object(s.ready_duration);
+	
+	if (s.locks_counted.load(std::memory_order_relaxed)) {
+		aeon::object & locks = ret["locks"] = aeon::map();
+		auto lock_object = [](asterales::lock_stats const & ls){
+			aeon::object lo = aeon::map();
+			lo["acquisitions"] = ls.acquisitions.load(std::memory_order_relaxed);
+			lo["contended"] = ls.contended.load(std::memory_order_relaxed);
+			lo["spins"] = ls.spins.load(std::memory_order_relaxed);
+			lo["parked"] = ls.parked.load(std::memory_order_relaxed);
+			return lo;
+		};
+		locks["queue"] = lock_object(s.lock_m2w);
+		locks["service"] = lock_object(s.lock_service);
+		locks["retire"] = lock_object(s.lock_retire);
+		locks["budget"] = lock_object(s.lock_budget);
+		locks["timer"] = lock_object(s.lock_timer);
+		locks["connections"] = lock_object(s.lock_instances);
+	}
+	return ret;
+}
+
+void reactor::set_lock_stats(bool enabled) {
+	stats_t & s = *stats_data;
+	s.locks_counted.store(enabled);
+	m2w_lock.set_stats(enabled ? &s.lock_m2w : nullptr);
+	service_lock.set_stats(enabled ? &s.lock_service : nullptr);
+	retire_lock.set_stats(enabled ? &s.lock_retire : nullptr);
+	budget_lock.set_stats(enabled ? &s.lock_budget : nullptr);
+	timer_lock.set_stats(enabled ? &s.lock_timer : nullptr);
+}
+
+// ================================================================================================
+// OUTBOUND
+
+struct resolved_address {
+	sockaddr_storage addr;
+	socklen_t len;
+};
+
+struct reactor::resolver_t {
+	struct cached {
+		std::vector<resolved_address> addrs; // empty for a failed lookup
+		uint64_t expires;
+	};
+	struct job {
+		std::string host, service, key;
+	};
+	
+	resolver_config cfg;
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<job> jobs;
+	std::unordered_map<std::string, std::vector<std::shared_ptr<connect_group>>> waiting; // lookups in flight, later connects to the same name join them
+	std::unordered_map<std::string, cached> cache;
+	std::vector<std::thread> threads;
+	bool running = true;
+	stats_t & stats;
+	
+	resolver_t(stats_t & s) : stats {s} {}
+	void run();
+	void stop();
+};
+
+// every address of one connect, raced with staggered starts, the first to connect gets the user protocol and the rest are closed
+struct reactor::connect_group : public std::enable_shared_from_this<connect_group> {
+	connect_group(reactor & r, std::shared_ptr<protocol_instantiator> const & pi_, resolver_config const & cfg_) : parent {r}, pi {pi_}, cfg {cfg_} {}
+	reactor & parent;
+	std::shared_ptr<protocol_instantiator> pi;
+	resolver_config const cfg; // copied under the resolver lock when the connect started
+	std::vector<resolved_address> addrs;
+	std::mutex lock;
+	size_t next = 0, pending = 0;
+	std::atomic_bool won {false}; // settled, by the first attempt to connect or by the timeout, later attempts only terminate
+	bool failed = false;
+	
+	void start(std::vector<resolved_address> const &);
+	void stagger();
+	void expire();
+	void attempt_failed();
+	bool launch(); // with lock held, starts attempts until one gets as far as connecting
+	void fail(std::unique_lock<std::mutex> &);
+};
+
+// ================================================================================================
+
 socket::~socket() {
 	if (FD != -1) {
 		shutdown(FD, SHUT_RDWR);
@@ -40,18 +298,93 @@ void socket::close() {
 	FD = -1;
 }
 
-struct sendfile_helper::impl_t {
+struct cached_file {
 	int fd;
 	struct stat finfo;
+	asterales::time::point checked;
+	cached_file(int fd, struct stat const & finfo) : fd(fd), finfo(finfo), checked(asterales::time::now<asterales::time::clock_type::monotonic>()) {}
+	~cached_file() { ::close(fd); }
+};
+
+typedef std::shared_ptr<cached_file> cached_file_ptr;
+
+static struct file_cache_t {
+	std::mutex lock;
+	std::list<std::pair<std::string, cached_file_ptr>> lru; // most recently used at the front
+	std::unordered_map<std::string, decltype(lru)::iterator> index;
+	size_t max_open = 256;
+	asterales::time::span revalidate {1};
+	
+	cached_file_ptr acquire(std::string const & path, bool & cold) {
+		auto now = asterales::time::now<asterales::time::clock_type::monotonic>();
+		std::unique_lock<std::mutex> lk {lock};
+		auto find = index.find(path);
+		if (find != index.end()) {
+			cached_file_ptr file = find->second->second;
+			lru.splice(lru.begin(), lru, find->second);
+			bool stale = now - file->checked > revalidate;
+			if (stale) file->checked = now; // claimed by this caller, everyone else keeps using the entry in the meantime
+			lk.unlock();
+			
+			// stat'd without the lock so a slow path lookup doesn't hold up every other sendfile
+			bool valid = true;
+			if (stale) {
+				struct stat cur;
+				valid = ::stat(path.c_str(), &cur) == 0 && cur.st_ino == file->finfo.st_ino && cur.st_dev == file->finfo.st_dev && cur.st_size == file->finfo.st_size && cur.st_mtim.tv_sec == file->finfo.st_mtim.tv_sec && cur.st_mtim.tv_nsec == file->finfo.st_mtim.tv_nsec;
+			}
+			if (valid) {
+				cold = false;
+				return file;
+			}
+			
+			lk.lock();
+			find = index.find(path);
+			if (find != index.end() && find->second->second == file) {
+				lru.erase(find->second);
+				index.erase(find);
+			}
+		}
+		lk.unlock();
+		
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) throw exception::sendfile_notfound {};
+		struct stat finfo;
+		if (fstat(fd, &finfo) || !S_ISREG(finfo.st_mode)) {
+			::close(fd);
+			throw exception::sendfile_notfile {};
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		cached_file_ptr file = std::make_shared<cached_file>(fd, finfo);
+		cold = true;
+		
+		lk.lock();
+		find = index.find(path);
+		if (find != index.end()) {
+			lru.erase(find->second);
+			index.erase(find);
+		}
+		if (max_open) {
+			lru.emplace_front(path, file);
+			index[path] = lru.begin();
+		}
+		while (lru.size() > max_open) {
+			index.erase(lru.back().first);
+			lru.pop_back();
+		}
+		return file;
+	}
+} file_cache;
+
+struct sendfile_helper::impl_t {
+	cached_file_ptr file;
 	off_t offset;
 	size_t count;
-	impl_t(std::string const & path, off_t offset, size_t count) : offset(offset), count(count) {
-		fd = ::open(path.c_str(), O_RDONLY);
-		if (fd < 0) throw exception::sendfile_notfound {};
-		fstat(fd, &finfo);
-		if (!S_ISREG(finfo.st_mode)) throw exception::sendfile_notfile {};
-		if (offset > finfo.st_size) throw exception::sendfile_badoffset {};
-		if (offset + count > static_cast<size_t>(finfo.st_size)) count = finfo.st_size - offset;
+	impl_t(std::string const & path, off_t offset_, size_t count_) : offset(offset_), count(count_) {
+		bool cold;
+		file = file_cache.acquire(path, cold);
+		if (offset > file->finfo.st_size) throw exception::sendfile_badoffset {};
+		if (count > static_cast<size_t>(file->finfo.st_size - offset)) count = file->finfo.st_size - offset;
+		if (cold && count) posix_fadvise(file->fd, offset, count, POSIX_FADV_WILLNEED);
 	}
 };
 
@@ -59,27 +392,83 @@ sendfile_helper::sendfile_helper(std::string const & path, off_t offset, size_t
 	impl.reset(new impl_t {path, offset, count});
 }
 
+sendfile_helper::sendfile_helper(sendfile_helper &&) = default;
+sendfile_helper::~sendfile_helper() = default;
+
 bool sendfile_helper::is_done() {
 	return !impl->count;
 }
 
 ssize_t sendfile_helper::work(connection & con) {
-	ssize_t amt = con.sendfile(impl->fd, &impl->offset, impl->count);
-	if (amt < 0) return -1;
-	impl->count -= amt;
-	return amt;
+	ssize_t ret = 0;
+	while (impl->count) {
+		errno = 0;
+		ssize_t amt = con.sendfile(impl->file->fd, &impl->offset, impl->count);
+		if (amt < 0) return -1;
+		if (amt == 0) {
+			if (errno) break; // would block
+			// end of file with bytes still owed, the file shrank since its size was taken, which the cache only notices on revalidation
+			errno = EIO;
+			return -1;
+		}
+		impl->count -= amt;
+		ret += amt;
+	}
+	return ret;
+}
+
+void sendfile_helper::cache_configure(size_t max_open, asterales::time::span revalidate) {
+	std::lock_guard<std::mutex> lk {file_cache.lock};
+	file_cache.max_open = max_open;
+	file_cache.revalidate = revalidate;
+	while (file_cache.lru.size() > max_open) {
+		file_cache.index.erase(file_cache.lru.back().first);
+		file_cache.lru.pop_back();
+	}
+}
+
+void sendfile_helper::cache_clear() {
+	std::lock_guard<std::mutex> lk {file_cache.lock};
+	file_cache.index.clear();
+	file_cache.lru.clear();
 }
 
-connection::connection(socket && sock) : socket(sock) {
+size_t sendfile_helper::cache_size() {
+	std::lock_guard<std::mutex> lk {file_cache.lock};
+	return file_cache.lru.size();
+}
+
+connection::connection(socket && sock) : socket(sock), read_hint(READ_HINT_MIN) {
 	sock.FD = -1;
 }
 
-connection::connection(connection && sock) : socket(sock) {
+connection::connection(connection && sock) : socket(sock), read_query(sock.read_query), read_hint(sock.read_hint), out_queue(std::move(sock.out_queue)), out_size(sock.out_size), splice_pipe {sock.splice_pipe[0], sock.splice_pipe[1]}, splice_staged(sock.splice_staged), zc_pending(std::move(sock.zc_pending)), zc_next(sock.zc_next), zc_copied(sock.zc_copied), zc_enabled(sock.zc_enabled) {
 	sock.FD = -1;
+	sock.out_size = 0;
+	sock.splice_pipe[0] = sock.splice_pipe[1] = -1;
+	sock.splice_staged = 0;
+}
+
+connection::~connection() {
+	if (splice_pipe[0] != -1) ::close(splice_pipe[0]);
+	if (splice_pipe[1] != -1) ::close(splice_pipe[1]);
 }
 
 ssize_t connection::read(char * buf, size_t buf_len) {
-	ssize_t e = recv(FD, buf, buf_len, 0);
+	ssize_t e = count_in(recv(FD, buf, buf_len, 0));
+	if (e == 0) return -1;
+	else if (e < 0) {
+		if (errno == EAGAIN
+			#if EAGAIN != EWOULDBLOCK
+			|| errno == EWOULDBLOCK
+			#endif
+		) return 0;
+		else return -1;
+	} else return e;
+}
+
+ssize_t connection::readv(struct iovec const * iov, int iovcnt) {
+	ssize_t e = count_in(::readv(FD, iov, iovcnt));
 	if (e == 0) return -1;
 	else if (e < 0) {
 		if (errno == EAGAIN
@@ -91,24 +480,49 @@ ssize_t connection::read(char * buf, size_t buf_len) {
 	} else return e;
 }
 
+// one per thread instead of on the stack, so protocols running on small fiber stacks can read too
+static char * read_overflow() {
+	static thread_local std::unique_ptr<char []> scratch {new char [READ_OVERFLOW_SIZE]};
+	return scratch.get();
+}
+
 ssize_t connection::read(buffer_assembly & buf, size_t cnt) {
-	char tmpbuf [TMPBUF_SIZE];
+	// the first segment is the buffer's own spare capacity, the second catches anything beyond the current hint so a single readv can still drain the socket
+	char * overflow = read_overflow();
 	ssize_t ret = 0;
-	while (true) {
-		size_t readnum = cnt < TMPBUF_SIZE ? cnt : TMPBUF_SIZE;
-		ssize_t e = connection::read(tmpbuf, readnum);
+	while (cnt) {
+		size_t want = cnt < read_hint ? cnt : read_hint;
+		if (read_query) {
+			int avail = 0;
+			if (ioctl(FD, FIONREAD, &avail) == 0 && avail > 0) want = cnt < static_cast<size_t>(avail) ? cnt : avail;
+		}
+		iovec iov [2];
+		iov[0].iov_base = buf.prepare(want);
+		iov[0].iov_len = want;
+		iov[1].iov_base = overflow;
+		iov[1].iov_len = cnt - want < READ_OVERFLOW_SIZE ? cnt - want : READ_OVERFLOW_SIZE;
+		ssize_t e = connection::readv(iov, iov[1].iov_len ? 2 : 1);
 		if (e < 0) return -1;
 		if (e == 0) break;
+		size_t got = e;
 		ret += e;
 		cnt -= e;
-		buf.write_many(&tmpbuf[0], e);
-		if (static_cast<size_t>(e) < readnum) break;
+		if (got > want) {
+			buf.commit(want);
+			buf.write(reinterpret_cast<buffer_assembly::byte_t const *>(overflow), got - want);
+			if (read_hint < READ_HINT_MAX) read_hint <<= 1;
+		} else {
+			buf.commit(got);
+			if (got == want && want == read_hint && read_hint < READ_HINT_MAX) read_hint <<= 1;
+			else if (got < read_hint >> 2 && read_hint > READ_HINT_MIN) read_hint >>= 1;
+		}
+		if (got < want + iov[1].iov_len) break;
 	}
 	return ret;
 }
 
 ssize_t connection::write(char const * buf, size_t buf_len) {
-	ssize_t e = send(FD, buf, buf_len, 0);
+	ssize_t e = count_out(send(FD, buf, buf_len, 0));
 	if (e < 0) {
 		if (errno == EAGAIN
 			#if EAGAIN != EWOULDBLOCK
@@ -135,8 +549,185 @@ ssize_t connection::write_consume(buffer_assembly & buf, size_t cnt) {
 	return e;
 }
 
+ssize_t connection::writev(struct iovec const * iov, int iovcnt, bool more) {
+	msghdr msg {};
+	msg.msg_iov = const_cast<struct iovec *>(iov);
+	msg.msg_iovlen = iovcnt;
+	ssize_t e = count_out(sendmsg(FD, &msg, more ? MSG_MORE : 0));
+	if (e < 0) {
+		if (errno == EAGAIN
+			#if EAGAIN != EWOULDBLOCK
+			|| errno == EWOULDBLOCK
+			#endif
+		) return 0;
+		else return -1;
+	} else return e;
+}
+
+template <typename B> static int gather(iovec * iov, std::initializer_list<B *> bufs) {
+	int iovcnt = 0;
+	for (B * buf : bufs) {
+		if (!buf->size()) continue;
+		if (iovcnt == WRITE_IOV_MAX) break;
+		iov[iovcnt].iov_base = const_cast<asterales::buffer_assembly::byte_t *>(buf->data());
+		iov[iovcnt].iov_len = buf->size();
+		iovcnt++;
+	}
+	return iovcnt;
+}
+
+ssize_t connection::write(std::initializer_list<buffer_assembly const *> bufs, bool more) {
+	iovec iov [WRITE_IOV_MAX];
+	int iovcnt = gather(iov, bufs);
+	if (!iovcnt) return 0;
+	return connection::writev(iov, iovcnt, more);
+}
+
+ssize_t connection::write_consume(std::initializer_list<buffer_assembly *> bufs, bool more) {
+	iovec iov [WRITE_IOV_MAX];
+	int iovcnt = gather(iov, bufs);
+	if (!iovcnt) return 0;
+	ssize_t e = connection::writev(iov, iovcnt, more);
+	if (e <= 0) return e;
+	size_t left = e;
+	for (buffer_assembly * buf : bufs) {
+		if (!left) break;
+		if (left >= buf->size()) {
+			left -= buf->size();
+			buf->clear();
+		} else {
+			buf->discard(left);
+			left = 0;
+		}
+	}
+	return e;
+}
+
+ssize_t connection::splice(int pipe_fd, size_t size) {
+	ssize_t e = count_out(::splice(pipe_fd, nullptr, FD, nullptr, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+	if (e < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	return e;
+}
+
+ssize_t connection::splice(int fd, off_t * offs, size_t size) {
+	if (splice_pipe[0] == -1 && pipe2(splice_pipe, O_NONBLOCK | O_CLOEXEC)) return -1;
+	ssize_t ret = 0;
+	while (true) {
+		if (splice_staged) {
+			ssize_t e = count_out(::splice(splice_pipe[0], nullptr, FD, nullptr, splice_staged, SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+			if (e < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? ret : -1;
+			splice_staged -= e;
+			size -= e;
+			ret += e;
+			if (splice_staged) return ret;
+		}
+		if (!size) return ret;
+		loff_t loffs = *offs;
+		ssize_t e = ::splice(fd, &loffs, splice_pipe[1], nullptr, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (e == 0) return ret;
+		if (e < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? ret : -1;
+		*offs = loffs;
+		splice_staged = e;
+	}
+}
+
+bool connection::zerocopy() {
+	zc_enabled = setsockopt(FD, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+	return zc_enabled;
+}
+
+ssize_t connection::write_zerocopy(std::shared_ptr<buffer_assembly const> const & buf, size_t offset) {
+	if (offset >= buf->size()) return 0;
+	// without SO_ZEROCOPY the kernel ignores MSG_ZEROCOPY and never posts a completion, so the buffer would be held forever
+	if (!zc_enabled) return connection::write(reinterpret_cast<char const *>(buf->data() + offset), buf->size() - offset);
+	ssize_t e = count_out(send(FD, buf->data() + offset, buf->size() - offset, MSG_ZEROCOPY));
+	if (e < 0) {
+		if (errno == ENOBUFS) return connection::write(reinterpret_cast<char const *>(buf->data() + offset), buf->size() - offset); // out of optmem for notifications, fall back to copying
+		if (errno == EAGAIN
+			#if EAGAIN != EWOULDBLOCK
+			|| errno == EWOULDBLOCK
+			#endif
+		) return 0;
+		else return -1;
+	}
+	zc_pending.emplace_back(zc_next++, buf);
+	return e;
+}
+
+size_t connection::reap_zerocopy() {
+	size_t ret = 0;
+	while (!zc_pending.empty()) {
+		char control [128];
+		msghdr msg {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(FD, &msg, MSG_ERRQUEUE) < 0) break;
+		for (cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+			sock_extended_err const * serr = reinterpret_cast<sock_extended_err const *>(CMSG_DATA(cm));
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			uint32_t lo = serr->ee_info, hi = serr->ee_data;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zc_copied += hi - lo + 1;
+			ret += hi - lo + 1;
+			zc_pending.erase(std::remove_if(zc_pending.begin(), zc_pending.end(), [lo, hi](auto const & p){ return p.first - lo <= hi - lo; }), zc_pending.end());
+		}
+	}
+	return ret;
+}
+
+void connection::queue(buffer_assembly && buf) {
+	if (!buf.size()) return;
+	out_size += buf.size();
+	out_queue.emplace_back(std::move(buf));
+}
+
+void connection::queue(buffer_assembly const & buf) {
+	if (!buf.size()) return;
+	out_size += buf.size();
+	out_queue.emplace_back(buf);
+}
+
+ssize_t connection::flush() {
+	ssize_t ret = 0;
+	while (out_size) {
+		iovec iov [WRITE_IOV_MAX];
+		int iovcnt = 0;
+		size_t attempt = 0;
+		for (auto it = out_queue.begin(); it != out_queue.end() && iovcnt < WRITE_IOV_MAX; it++, iovcnt++) {
+			iov[iovcnt].iov_base = it->data();
+			iov[iovcnt].iov_len = it->size();
+			attempt += it->size();
+		}
+		ssize_t e = connection::writev(iov, iovcnt);
+		if (e < 0) return -1;
+		if (e == 0) break;
+		ret += e;
+		out_size -= e;
+		size_t left = e;
+		while (left) {
+			buffer_assembly & front = out_queue.front();
+			if (left < front.size()) {
+				front.discard(left);
+				break;
+			}
+			left -= front.size();
+			out_queue.pop_front();
+		}
+		if (static_cast<size_t>(e) < attempt) break;
+	}
+	return ret;
+}
+
+bool connection::cork() {
+	return setsockopt(FD, IPPROTO_TCP, TCP_CORK, &enable, sizeof(enable)) == 0;
+}
+
+bool connection::uncork() {
+	return setsockopt(FD, IPPROTO_TCP, TCP_CORK, &disable, sizeof(disable)) == 0;
+}
+
 ssize_t connection::sendfile(int fd, off_t * offs, size_t size) {
-	ssize_t e = ::sendfile(FD, fd, offs, size);
+	ssize_t e = count_out(::sendfile(FD, fd, offs, size));
 	if (e < 0) {
 		if (errno == EAGAIN
 			#if EAGAIN != EWOULDBLOCK
@@ -174,6 +765,18 @@ listener::listener(uint16_t port, accept_cb && cb) : _accept_cb(std::forward<acc
 	if (listen(FD, SOMAXCONN)) throw exception::listen_start {};
 }
 
+listener::listener(int fd, accept_cb && cb) : _accept_cb(std::forward<accept_cb &&>(cb)) {
+	FD = fd;
+	fcntl(FD, F_SETFL, fcntl(FD, F_GETFL) | O_NONBLOCK);
+	socklen_t alen = sizeof(addr);
+	getsockname(FD, reinterpret_cast<struct sockaddr *>(&addr), &alen);
+}
+
+listener::~listener() {
+	if (FD != -1) ::close(FD);
+	FD = -1;
+}
+
 void listener::accept() noexcept {
 	while (true) {
 		socket temp;
@@ -185,13 +788,34 @@ void listener::accept() noexcept {
 }
 
 reactor::reactor(bool create_master_thread, unsigned int workers_num) : last_pulse { asterales::time::now<asterales::time::clock_type::monotonic>() } {
+	rlimit rl;
+	size_t max_fds = SLOT_MAX_FDS;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_max != RLIM_INFINITY && rl.rlim_max < max_fds) max_fds = rl.rlim_max;
+	slot_chunks_num = (max_fds + SLOT_CHUNK_SIZE - 1) >> slot_chunk_bits;
+	slot_chunks.reset(new std::atomic<instance_slot *> [slot_chunks_num]);
+	for (size_t i = 0; i < slot_chunks_num; i++) slot_chunks[i].store(nullptr);
+	stats_data.reset(new stats_t);
+	worker_epochs.reset(new std::atomic_uint64_t [workers_num]);
+	for (size_t i = 0; i < workers_num; i++) worker_epochs[i].store(0);
+	worker_lane.reset(new std::atomic_uint32_t [workers_num]);
+	for (size_t i = 0; i < workers_num; i++) worker_lane[i].store(0);
+	m2w_lanes.resize(1);
+	
+	resolver.reset(new resolver_t {*stats_data});
+	
 	epoll_obj = epoll_create(1);
-	epoll_mevt = new epoll_event [MAX_EPOLL_EVENTS];
-	for (unsigned int i = 0; i < workers_num; i++) workers.push_back( new std::thread { &reactor::worker_run, this } );
+	epoll_mevt = new epoll_event [epoll_mevt_size];
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	epoll_event tevt {};
+	tevt.data.u64 = EPOLL_DATA(timer_fd, 0);
+	tevt.events = EPOLLIN;
+	epoll_ctl(epoll_obj, EPOLL_CTL_ADD, timer_fd, &tevt);
+	for (unsigned int i = 0; i < workers_num; i++) workers.push_back( new std::thread { &reactor::worker_run, this, i } );
 	if (create_master_thread) master_thread = new std::thread { [this](){ while (run_sem) master_loop(); } };
 }
 
 reactor::~reactor() {
+	resolver->stop();
 	run_sem.store(false);
 	if (master_thread) {
 		if (master_thread->joinable()) master_thread->join();
@@ -204,10 +828,235 @@ reactor::~reactor() {
 		if (worker->joinable()) worker->join();
 		delete worker;
 	}
+	for (auto & r : retired) delete r.second;
+	for (size_t i = 0; i < slot_chunks_num; i++) {
+		instance_slot * chunk = slot_chunks[i].load();
+		if (!chunk) continue;
+		for (size_t j = 0; j < SLOT_CHUNK_SIZE; j++) {
+			instance * inst = chunk[j].inst.load();
+			if (inst) delete inst;
+		}
+		delete [] chunk;
+	}
+	timers.clear();
+	close(timer_fd);
 	close(epoll_obj);
 	if (EPOLLMEVT) delete [] EPOLLMEVT;
 }
 
+reactor::instance_slot * reactor::slot_find(int fd) const {
+	size_t ci = static_cast<size_t>(fd) >> slot_chunk_bits;
+	if (fd < 0 || ci >= slot_chunks_num) return nullptr;
+	instance_slot * chunk = slot_chunks[ci].load(std::memory_order_acquire);
+	if (!chunk) return nullptr;
+	return &chunk[fd & (SLOT_CHUNK_SIZE - 1)];
+}
+
+reactor::instance_slot * reactor::slot_acquire(int fd) {
+	size_t ci = static_cast<size_t>(fd) >> slot_chunk_bits;
+	if (fd < 0 || ci >= slot_chunks_num) return nullptr;
+	instance_slot * chunk = slot_chunks[ci].load(std::memory_order_acquire);
+	if (!chunk) {
+		instance_slot * fresh = new instance_slot [SLOT_CHUNK_SIZE];
+		if (slot_chunks[ci].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) chunk = fresh;
+		else delete [] fresh;
+	}
+	int high = slot_high.load();
+	while (high < fd && !slot_high.compare_exchange_weak(high, fd));
+	return &chunk[fd & (SLOT_CHUNK_SIZE - 1)];
+}
+
+void reactor::accept_connection(connection && con, std::unique_ptr<protocol> && pi) {
+	instance_slot * slot = slot_acquire(con.FD);
+	if (!slot) {
+		printf("WARNING: a connection was dropped because its descriptor (%i) is beyond the reactor's instance table\n", con.FD);
+		return;
+	}
+	stats_data->accepted.fetch_add(1, std::memory_order_relaxed);
+	uint32_t gen = slot->generation.fetch_add(1) + 1;
+	slot->lane.store(pick_lane(con.FD), std::memory_order_relaxed);
+	instance * inst = new instance { *this, std::forward<connection>(con), std::forward<std::unique_ptr<protocol> &&>(pi), gen };
+	instance * prev = slot->inst.exchange(inst);
+	if (prev) retire(nullptr, prev); // previous owner closed its descriptor without terminating through the reactor
+	inst->add_epoll();
+}
+
+uint32_t reactor::pick_lane(int fd) {
+	std::unique_lock<asterales::spinlock> lk {m2w_lock};
+	if (m2w_lanes.size() <= 1) return 0;
+	lk.unlock();
+	// the cpu that last processed the socket's packets tells which node its traffic arrives on
+	size_t ni = topology::npos;
+	int cpu = -1;
+	socklen_t len = sizeof(cpu);
+	if (!getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) && cpu >= 0) {
+		topology::machine const & sys = topology::get();
+		topology::cpu const * c = sys.find(cpu);
+		if (c) ni = sys.node_index(c->node);
+	}
+	lk.lock();
+	size_t lanes = m2w_lanes.size();
+	if (lanes <= 1) return 0;
+	// a cpu outside the process' own or a node without workers has no lane, such connections are spread round robin
+	if (ni != topology::npos && ni < node_lane.size() && node_lane[ni] < lanes) return node_lane[ni];
+	return lane_rr.fetch_add(1, std::memory_order_relaxed) % lanes;
+}
+
+size_t reactor::m2w_depth() const {
+	size_t depth = 0;
+	for (auto const & lane : m2w_lanes) depth += lane.size();
+	return depth;
+}
+
+void reactor::adopt(int fd, std::shared_ptr<protocol_instantiator> const & pi_in) {
+	sockaddr_storage sa {};
+	socklen_t alen = sizeof(sa);
+	getsockname(fd, reinterpret_cast<sockaddr *>(&sa), &alen);
+	uint16_t port = sa.ss_family == AF_INET6 ? ntohs(reinterpret_cast<sockaddr_in6 *>(&sa)->sin6_port) : ntohs(reinterpret_cast<sockaddr_in *>(&sa)->sin_port);
+	service_lock.lock();
+	services[port] = std::unique_ptr<listener> { new listener { fd, [this, pi = pi_in] (connection && con) mutable { this->accept_connection(std::forward<connection &&>(con), pi); } } };
+	epoll_register(fd);
+	service_lock.unlock();
+}
+
+std::vector<int> reactor::listener_descriptors() {
+	std::vector<int> ret;
+	std::lock_guard<asterales::spinlock> lk {service_lock};
+	for (auto const & li : services) ret.push_back(li.second->FD);
+	return ret;
+}
+
+bool reactor::drain(std::chrono::milliseconds deadline) {
+	auto until = std::chrono::steady_clock::now() + deadline;
+	{
+		std::lock_guard<asterales::spinlock> lk {service_lock};
+		for (auto const & li : services) epoll_ctl(epoll_obj, EPOLL_CTL_DEL, li.second->FD, nullptr);
+		services.clear();
+	}
+	
+	auto live = [this](bool notify) {
+		size_t count = 0;
+		uint64_t stamp = mono_ns();
+		int high = slot_high.load();
+		std::lock_guard<asterales::spinlock> lk {m2w_lock};
+		for (int fd = 0; fd <= high; fd++) {
+			instance_slot * slot = slot_find(fd);
+			if (!slot || !slot->inst.load()) continue;
+			count++;
+			if (notify) m2w_push(fd, slot->generation.load(), reason::drain, stamp);
+		}
+		return count;
+	};
+	
+	if (live(true)) {
+		m2w_cv_mut.lock();
+		m2w_cv_mut.unlock();
+		m2w_cv.notify_all();
+	}
+	while (live(false)) {
+		if (std::chrono::steady_clock::now() >= until) return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return true;
+}
+
+void reactor::set_placement(topology::placement const & pl) {
+	topology::machine const & sys = topology::get();
+	// lanes only for the nodes that actually get workers, numbered in the order they first appear
+	std::vector<uint32_t> map (sys.nodes.size(), UINT32_MAX);
+	std::vector<uint32_t> own (workers.size(), 0);
+	uint32_t lanes = 0;
+	std::vector<topology::placement::slot> plan = pl.plan(workers.size());
+	for (size_t i = 0; i < workers.size(); i++) {
+		topology::pin(*workers[i], plan[i].cpus);
+		if (plan[i].node == topology::npos) continue; // unpinned, shares the first lane
+		if (map[plan[i].node] == UINT32_MAX) map[plan[i].node] = lanes++;
+		own[i] = map[plan[i].node];
+	}
+	if (!lanes) lanes = 1;
+	std::lock_guard<asterales::spinlock> lk {m2w_lock};
+	node_lane = std::move(map);
+	for (size_t i = 0; i < workers.size(); i++) worker_lane[i].store(own[i]);
+	while (m2w_lanes.size() > lanes) {
+		auto & last = m2w_lanes.back();
+		for (; !last.empty(); last.pop()) m2w_lanes.front().push(last.front());
+		m2w_lanes.pop_back();
+	}
+	m2w_lanes.resize(lanes);
+}
+
+void reactor::retire(instance_slot * slot, instance * inst) {
+	if (slot) {
+		instance * expected = inst;
+		if (!slot->inst.compare_exchange_strong(expected, nullptr)) return;
+	}
+	if (inst->accounted) {
+		size_t total = queued_bytes.fetch_sub(inst->accounted) - inst->accounted;
+		inst->accounted = 0;
+		if (total <= wm.budget_low) release_budget();
+	}
+	stats_data->closed.fetch_add(1, std::memory_order_relaxed);
+	if (inst->con.FD != -1) epoll_ctl(epoll_obj, EPOLL_CTL_DEL, inst->con.FD, nullptr);
+	uint64_t tag = epoch.fetch_add(1);
+	std::lock_guard<asterales::spinlock> lk {retire_lock};
+	retired.emplace_back(tag, inst);
+}
+
+void reactor::reclaim() {
+	std::vector<instance *> freeing;
+	{
+		std::unique_lock<asterales::spinlock> lk {retire_lock, std::try_to_lock};
+		if (!lk || retired.empty()) return;
+		uint64_t oldest = UINT64_MAX;
+		for (size_t i = 0; i < workers.size(); i++) {
+			uint64_t e = worker_epochs[i].load();
+			if (e && e < oldest) oldest = e;
+		}
+		auto it = std::partition(retired.begin(), retired.end(), [oldest](auto const & r){ return r.first >= oldest; });
+		for (auto i = it; i != retired.end(); i++) freeing.push_back(i->second);
+		retired.erase(it, retired.end());
+	}
+	for (instance * inst : freeing) delete inst;
+}
+
+bool reactor::apply_backpressure(instance * inst) {
+	size_t q = inst->con.queued();
+	size_t total;
+	bool drained = q < inst->accounted;
+	if (drained) total = queued_bytes.fetch_sub(inst->accounted - q) - (inst->accounted - q);
+	else total = queued_bytes.fetch_add(q - inst->accounted) + (q - inst->accounted);
+	inst->accounted = q;
+	
+	bool throttled = inst->throttled;
+	if (!throttled && (q > wm.high || total > wm.budget_high)) throttled = true;
+	else if (throttled && q <= wm.low && total <= wm.budget_low) throttled = false;
+	if (throttled != inst->throttled) {
+		inst->throttled = throttled;
+		inst->proto->backpressure(throttled);
+	}
+	if (throttled && q <= wm.low && !inst->in_budget_wait) {
+		inst->in_budget_wait = true;
+		std::lock_guard<asterales::spinlock> lk {budget_lock};
+		budget_waiters.emplace_back(inst->con.FD, inst->generation);
+	}
+	if (drained && total <= wm.budget_low) release_budget();
+	return throttled;
+}
+
+void reactor::release_budget() {
+	std::vector<std::pair<int, uint32_t>> waking;
+	{
+		std::lock_guard<asterales::spinlock> lk {budget_lock};
+		if (budget_waiters.empty()) return;
+		waking.swap(budget_waiters);
+	}
+	m2w_lock.lock();
+	uint64_t stamp = mono_ns();
+	for (auto const & w : waking) m2w_push(w.first, w.second, REASON_REEVALUATE, stamp);
+	m2w_lock.unlock();
+	m2w_cv.notify_all();
+}
+
 void reactor::epoll_register(int fd) {
 	epoll_event evt {};
 	evt.data.fd = fd;
@@ -215,57 +1064,138 @@ void reactor::epoll_register(int fd) {
 	epoll_ctl(epoll_obj, EPOLL_CTL_ADD, fd, &evt);
 }
 
+void reactor::wake(int fd, uint32_t generation) {
+	m2w_lock.lock();
+	m2w_push(fd, generation, reason::wake, mono_ns());
+	m2w_lock.unlock();
+	m2w_cv_mut.lock();
+	m2w_cv_mut.unlock();
+	m2w_cv.notify_one();
+}
+
+static void arm_timer(int fd, uint64_t deadline) {
+	itimerspec its {};
+	its.it_value.tv_sec = deadline / NANO;
+	its.it_value.tv_nsec = deadline % NANO;
+	timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void reactor::schedule(std::chrono::milliseconds delay, std::function<void()> && fn) {
+	uint64_t deadline = mono_ns() + std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count();
+	std::lock_guard<asterales::spinlock> lk {timer_lock};
+	auto it = timers.emplace(deadline, std::move(fn));
+	if (it == timers.begin()) arm_timer(timer_fd, deadline);
+}
+
+void reactor::run_timers() {
+	uint64_t expirations;
+	while (read(timer_fd, &expirations, sizeof(expirations)) > 0);
+	std::vector<std::function<void()>> due;
+	{
+		std::lock_guard<asterales::spinlock> lk {timer_lock};
+		auto end = timers.upper_bound(mono_ns());
+		for (auto i = timers.begin(); i != end; i++) due.push_back(std::move(i->second));
+		timers.erase(timers.begin(), end);
+		if (!timers.empty()) arm_timer(timer_fd, timers.begin()->first);
+	}
+	for (auto & fn : due) fn();
+}
+
 void reactor::master(std::function<bool()> pred) {
 	while (pred()) master_loop();
 }
 
 void reactor::master_loop() {
 	
-	int nfd = epoll_wait(epoll_obj, EPOLLMEVT, MAX_EPOLL_EVENTS, 1000);
+	int nfd = epoll_wait(epoll_obj, EPOLLMEVT, epoll_mevt_size, 1000);
 	if (nfd < 0) {
+		if (errno == EINTR) return;
 		printf("ERROR: epoll_wait returned %i\n", nfd);
 		run_sem.store(false);
 		return;
 	}
 	
+	uint64_t stamp = mono_ns();
+	
 	service_lock.lock();
 	for (auto & li : services) {
 		li.second->accept();;
 	}
 	service_lock.unlock();
 	
+	uint64_t ev_read = 0, ev_write = 0, ev_error = 0;
+	bool timers_due = false;
 	m2w_lock.lock();
 	for (int i = 0; i < nfd; i++) {
+		if (EPOLLMEVT[i].data.u64 == EPOLL_DATA(timer_fd, 0)) {
+			timers_due = true;
+			continue;
+		}
 		reason::type rsn = 0;
-		if (EPOLLMEVT[i].events & EPOLLIN) rsn |= reason::read_available;
-		if (EPOLLMEVT[i].events & EPOLLOUT) rsn |= reason::write_available;
-		m2w_queue.emplace(static_cast<int>(EPOLLMEVT[i].data.fd), rsn);
+		if (EPOLLMEVT[i].events & EPOLLIN) { rsn |= reason::read_available; ev_read++; }
+		if (EPOLLMEVT[i].events & EPOLLOUT) { rsn |= reason::write_available; ev_write++; }
+		if (EPOLLMEVT[i].events & EPOLLERR) { rsn |= reason::error; ev_error++; }
+		uint64_t data = EPOLLMEVT[i].data.u64;
+		m2w_push(static_cast<int>(data & 0xFFFFFFFF), static_cast<uint32_t>(data >> 32), rsn, stamp);
 	}
+	uint64_t depth = m2w_depth();
 	m2w_lock.unlock();
 	
+	stats_t & s = *stats_data;
+	if (ev_read) s.ev_read.fetch_add(ev_read, std::memory_order_relaxed);
+	if (ev_write) s.ev_write.fetch_add(ev_write, std::memory_order_relaxed);
+	if (ev_error) s.ev_error.fetch_add(ev_error, std::memory_order_relaxed);
+	if (depth > s.queue_max.load(std::memory_order_relaxed)) s.queue_max.store(depth, std::memory_order_relaxed);
+	
+	if (timers_due) run_timers();
+	
 	auto now = asterales::time::now<asterales::time::clock_type::monotonic>();
-	if (now - last_pulse > asterales::time::span {5}) {
+	if (now - last_pulse > pulse_interval) {
 		last_pulse = now;
-		for (auto & i : instances) {
+		int high = slot_high.load();
+		for (int fd = 0; fd <= high; fd++) {
+			instance_slot * slot = slot_find(fd);
+			if (!slot || !slot->inst.load(std::memory_order_relaxed)) continue;
 			m2w_lock.lock();
-			m2w_queue.emplace(i.first, reason::pulse);
+			m2w_push(fd, slot->generation.load(std::memory_order_relaxed), reason::pulse, stamp);
 			m2w_lock.unlock();
+			s.ev_pulse.fetch_add(1, std::memory_order_relaxed);
 		}
 	}
 	
+	reclaim();
+	
 	m2w_cv_mut.lock();
 	m2w_cv_mut.unlock();
 	m2w_cv.notify_all();
+	
+	// a full array means more events were likely left waiting, grow right away but only shrink after a sustained lull
+	if (static_cast<size_t>(nfd) == epoll_mevt_size && epoll_mevt_size < MAX_EPOLL_EVENTS) {
+		delete [] EPOLLMEVT;
+		epoll_mevt_size <<= 1;
+		epoll_mevt = new epoll_event [epoll_mevt_size];
+		epoll_lull = 0;
+	} else if (static_cast<size_t>(nfd) < epoll_mevt_size >> 3 && epoll_mevt_size > MIN_EPOLL_EVENTS) {
+		if (++epoll_lull >= EPOLL_SHRINK_TURNS) {
+			delete [] EPOLLMEVT;
+			epoll_mevt_size >>= 1;
+			epoll_mevt = new epoll_event [epoll_mevt_size];
+			epoll_lull = 0;
+		}
+	} else epoll_lull = 0;
 }
-void reactor::worker_run() {
+void reactor::worker_run(unsigned int index) {
+	
+	std::atomic_uint64_t & local_epoch = worker_epochs[index];
+	worker_stats ws;
 	
 	while (run_sem) {
 		{
 			std::unique_lock<std::mutex> lk {m2w_cv_mut};
 			if (!run_sem) return;
 			m2w_cv.wait_for(lk, std::chrono::milliseconds(5000), [this] {
-				std::lock_guard {m2w_lock};
-				return (!run_sem) || (!m2w_queue.empty());
+				std::lock_guard<asterales::spinlock> lk {m2w_lock};
+				return (!run_sem) || m2w_depth();
 			});
 		}
 		
@@ -274,60 +1204,108 @@ void reactor::worker_run() {
 		while (true) {
 			
 			std::unique_lock<asterales::spinlock> m2w_ulk {m2w_lock};
-			if (m2w_queue.empty()) break;
-			auto msg = m2w_queue.front();
-			m2w_queue.pop();
-			m2w_ulk.unlock();
-			
-			instance_lock.read_access();
-			auto inst_find = instances.find(msg.descriptor);
-			if (inst_find == instances.end()) {
-				instance_lock.read_done();
-				continue;
+			size_t lanes = m2w_lanes.size(), own = worker_lane[index].load(std::memory_order_relaxed);
+			std::queue<m2w_msg> * lane = nullptr;
+			for (size_t i = 0; i < lanes && !lane; i++) {
+				if (!m2w_lanes[(own + i) % lanes].empty()) lane = &m2w_lanes[(own + i) % lanes];
 			}
+			if (!lane) break;
+			auto msg = lane->front();
+			lane->pop();
+			m2w_ulk.unlock();
 			
-			std::shared_ptr<instance> inst = inst_find->second;
-			instance_lock.read_done();
-			
-			if (!inst->use_lock.try_lock()) continue;
-			detail d { msg.r };
-			
-			signal sig {};
+			instance_slot * slot = slot_find(msg.descriptor);
+			if (!slot) continue;
 			
-			try {
-				sig = inst->proto->ready(inst->con, d);
-			} catch (exception::generic const & e) {
-				printf("WARNING: a connection was terminated after catching a generic exception with the following message:\n%s\n", e.what());
-				sig.m |= signal::mask::terminate;
-			} catch (...) {
-				printf("WARNING: a connection was terminated after catching an uncaught exception\n");
-				sig.m |= signal::mask::terminate;
-			}
+			local_epoch.store(epoch.load());
 			
-			if (sig.m & signal::mask::terminate) {
-				instance_lock.write_lock();
-				instances.erase(msg.descriptor);
-				instance_lock.write_unlock();
-				inst->use_lock.unlock();
+			instance * inst = slot->inst.load();
+			if (!inst || inst->generation != msg.generation) {
+				local_epoch.store(0, std::memory_order_release);
 				continue;
 			}
 			
-			if (sig.m & signal::mask::switch_protocols) {
-				inst->proto = std::move(sig.protocol_switch);
-				sig.m = inst->proto->default_mask();
+			// reasons are merged into pending before trying the lock, whoever holds it picks them up after unlocking, so no event is lost while another worker is inside ready
+			inst->pending.fetch_or(msg.r);
+			while (inst->use_lock.try_lock()) {
+				if (slot->inst.load() != inst) { // terminated while we were queued for the lock
+					inst->use_lock.unlock();
+					break;
+				}
+				reason::type r = inst->pending.exchange(0);
+				if (!r) {
+					inst->use_lock.unlock();
+					if (inst->pending.load()) continue;
+					break;
+				}
+				bool alive = dispatch(slot, inst, r, msg.stamp, ws);
+				if (++ws.dispatched >= STATS_MERGE_INTERVAL) ws.merge(*stats_data);
+				if (!alive) break;
+				if (!inst->pending.load()) break;
 			}
 			
-			int flags = 0;
-			if (sig.m & signal::mask::wait_for_read) flags |= EPOLLIN;
-			if (sig.m & signal::mask::wait_for_write) flags |= EPOLLOUT;
-			inst->update_epoll(flags);
-			
-			inst->use_lock.unlock();
+			local_epoch.store(0, std::memory_order_release);
 		}
+		
+		ws.merge(*stats_data);
+		reclaim();
 	}
 }
 
-reactor::instance::instance(reactor const & parent, connection && con, std::unique_ptr<protocol> && pr) : parent(parent), con(std::forward<connection>(con)), proto(std::forward<std::unique_ptr<protocol> &&>(pr)) {
+bool reactor::dispatch(instance_slot * slot, instance * inst, reason::type r, uint64_t stamp, worker_stats & ws) {
+	
+	if (inst->con.zerocopy_pending()) inst->con.reap_zerocopy();
+	detail d { static_cast<reason::type>(r & ~REASON_REEVALUATE), trigger == trigger_mode::edge, inst->generation };
+	if (inst->throttled) d.ready_reason &= ~reason::read_available; // readiness that raced the pause, re-arming EPOLLIN reports it again once reading resumes
+	if (r & REASON_REEVALUATE) inst->in_budget_wait = false;
+	
+	signal sig {};
+	
+	try {
+		if (d.ready_reason) {
+			uint64_t start = mono_ns();
+			ws.wakeup_to_ready[histogram_bucket(start - stamp)]++;
+			sig = inst->proto->ready(inst->con, d);
+			ws.ready_duration[histogram_bucket(mono_ns() - start)]++;
+		} else sig.m = inst->last_mask;
+	} catch (exception::generic const & e) {
+		printf("WARNING: a connection was terminated after catching a generic exception with the following message:\n%s\n", e.what());
+		sig.m |= signal::mask::terminate;
+	} catch (...) {
+		printf("WARNING: a connection was terminated after catching an uncaught exception\n");
+		sig.m |= signal::mask::terminate;
+	}
+	
+	if (inst->con.queued() && inst->con.flush() < 0) sig.m |= signal::mask::terminate;
+	
+	if (sig.m & signal::mask::terminate) {
+		// unpublished before unlocking, a worker that gets the lock afterwards sees the slot moved on and leaves the instance alone
+		instance * expected = inst;
+		bool owned = slot->inst.compare_exchange_strong(expected, nullptr);
+		inst->use_lock.unlock();
+		if (owned) retire(nullptr, inst);
+		return false;
+	}
+	
+	if (sig.m & signal::mask::switch_protocols) {
+		setmask_cb cb = std::move(inst->proto->set_mask);
+		inst->proto = std::move(sig.protocol_switch);
+		inst->proto->set_mask = std::move(cb);
+		sig.m = inst->proto->default_mask();
+	}
+	
+	inst->last_mask = sig.m;
+	bool throttled = apply_backpressure(inst);
+	int flags = 0;
+	if (sig.m & signal::mask::wait_for_read && !throttled) flags |= EPOLLIN;
+	if (sig.m & signal::mask::wait_for_write || inst->con.queued()) flags |= EPOLLOUT;
+	inst->update_epoll(flags);
+	
+	inst->use_lock.unlock();
+	return true;
+}
+
+reactor::instance::instance(reactor const & parent, connection && con, std::unique_ptr<protocol> && pr, uint32_t generation) : parent(parent), generation(generation), con(std::forward<connection>(con)), proto(std::forward<std::unique_ptr<protocol> &&>(pr)) {
 	proto->set_mask = [this](signal::mask::type new_mask){
 		if (new_mask & signal::mask::terminate) {
 			this->con.close();
@@ -339,13 +1317,18 @@ reactor::instance::instance(reactor const & parent, connection && con, std::uniq
 		this->update_epoll(evt);
 	};
 	
+	if (parent.stats_data->locks_counted.load(std::memory_order_relaxed)) use_lock.set_stats(&parent.stats_data->lock_instances);
+	
 	epoll_evt = new epoll_event {};
-	EPOLLEVT->data.fd = this->con.FD;
-	EPOLLEVT->events = EPOLLONESHOT;
-	auto dmask = proto->default_mask();
+	EPOLLEVT->data.u64 = EPOLL_DATA(this->con.FD, generation);
+	EPOLLEVT->events = parent.trigger == trigger_mode::edge ? EPOLLET : EPOLLONESHOT;
+	auto dmask = last_mask = proto->default_mask();
 	if (dmask & signal::mask::wait_for_read) EPOLLEVT->events |= EPOLLIN;
 	if (dmask & signal::mask::wait_for_write) EPOLLEVT->events |= EPOLLOUT;
-	epoll_ctl(parent.epoll_obj, EPOLL_CTL_ADD, this->con.FD, EPOLLEVT);
+}
+
+void reactor::instance::add_epoll() {
+	epoll_ctl(parent.epoll_obj, EPOLL_CTL_ADD, con.FD, EPOLLEVT);
 }
 reactor::instance::~instance() {
 	epoll_ctl(parent.epoll_obj, EPOLL_CTL_DEL, con.FD, EPOLLEVT);
@@ -353,75 +1336,726 @@ reactor::instance::~instance() {
 }
 
 void reactor::instance::update_epoll(int flags) {
-	flags |= EPOLLONESHOT;
+	if (parent.trigger == trigger_mode::edge) {
+		flags |= EPOLLET;
+		if (static_cast<uint32_t>(flags) == EPOLLEVT->events) return; // still armed, edge triggered interest only changes with the mask
+	} else flags |= EPOLLONESHOT;
 	EPOLLEVT->events = flags;
 	epoll_ctl(parent.epoll_obj, EPOLL_CTL_MOD, con.FD, EPOLLEVT);
 }
 
-struct connection_protocol : reactor::protocol {
-	connection_protocol() = default;
-	~connection_protocol() {
-		if (addr) freeaddrinfo(addr);
+void reactor::set_resolver_config(resolver_config const & cfg) {
+	std::lock_guard<std::mutex> lk {resolver->lock};
+	resolver->cfg = cfg;
+}
+
+static std::vector<resolved_address> resolve(std::string const & host, std::string const & service) {
+	addrinfo hints {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	std::vector<resolved_address> ret, v6, v4;
+	addrinfo * res = nullptr;
+	if (getaddrinfo(host.c_str(), service.c_str(), &hints, &res)) return ret;
+	for (addrinfo * ai = res; ai != nullptr; ai = ai->ai_next) {
+		if (ai->ai_family != AF_INET6 && ai->ai_family != AF_INET) continue;
+		resolved_address ra {};
+		memcpy(&ra.addr, ai->ai_addr, ai->ai_addrlen);
+		ra.len = ai->ai_addrlen;
+		(ai->ai_family == AF_INET6 ? v6 : v4).push_back(ra);
 	}
+	freeaddrinfo(res);
 	
-	virtual reactor::signal ready(connection & c, reactor::detail const &) override {
+	// alternate families starting with IPv6 so a broken path in either one only costs a stagger delay
+	for (size_t i = 0; i < std::max(v6.size(), v4.size()); i++) {
+		if (i < v6.size()) ret.push_back(v6[i]);
+		if (i < v4.size()) ret.push_back(v4[i]);
+	}
+	return ret;
+}
+
+void reactor::resolver_t::run() {
+	std::unique_lock<std::mutex> lk {lock};
+	while (true) {
+		cv.wait(lk, [this](){ return !running || !jobs.empty(); });
+		if (!running) return;
+		job j = std::move(jobs.front());
+		jobs.pop_front();
+		lk.unlock();
+		
+		stats.resolve_lookups.fetch_add(1, std::memory_order_relaxed);
+		std::vector<resolved_address> addrs = resolve(j.host, j.service);
+		
+		lk.lock();
+		uint64_t now = mono_ns();
+		if (cache.size() >= RESOLVER_CACHE_PRUNE) {
+			for (auto i = cache.begin(); i != cache.end();) {
+				if (i->second.expires <= now) i = cache.erase(i);
+				else i++;
+			}
+		}
+		std::chrono::milliseconds ttl = addrs.empty() ? cfg.negative_ttl : cfg.ttl;
+		cache[j.key] = { addrs, now + std::chrono::duration_cast<std::chrono::nanoseconds>(ttl).count() };
+		std::vector<std::shared_ptr<connect_group>> groups;
+		auto w = waiting.find(j.key);
+		if (w != waiting.end()) {
+			groups.swap(w->second);
+			waiting.erase(w);
+		}
+		lk.unlock();
+		for (auto & g : groups) g->start(addrs);
+		lk.lock();
+	}
+}
+
+void reactor::resolver_t::stop() {
+	{
+		std::lock_guard<std::mutex> lk {lock};
+		running = false;
+	}
+	cv.notify_all();
+	for (std::thread & t : threads) if (t.joinable()) t.join();
+	threads.clear();
+}
+
+struct reactor::connect_protocol : public reactor::protocol {
+	connect_protocol(std::shared_ptr<connect_group> const & g) : group {g} {}
+	
+	virtual reactor::signal ready(connection & c, reactor::detail const & d) override {
 		reactor::signal s;
 		
-		int serr;
-		socklen_t len;
-		int gerr = getsockopt(c.FD, SOL_SOCKET, SO_ERROR, &serr, &len);
+		int serr = 0;
+		socklen_t len = sizeof(serr);
+		if (getsockopt(c.FD, SOL_SOCKET, SO_ERROR, &serr, &len) == -1) serr = errno;
 		
-		if (gerr == -1) throw exception::connection_establish {};
-		if (serr == EINPROGRESS) {
-			s.m = reactor::signal::mask::wait_for_read;
-			return s;
-		} else if (serr == 0) {
-			s.m = reactor::signal::mask::switch_protocols;
-			s.protocol_switch = pi->instantiate();
-			return s;
+		if (serr) {
+			group->attempt_failed();
+			s.m = reactor::signal::mask::terminate;
+		} else if (!(d.ready_reason & reason::write_available)) {
+			// still connecting, give up once another address already won
+			s.m = group->won ? reactor::signal::mask::terminate : reactor::signal::mask::wait_for_write;
+		} else if (group->won.exchange(true)) {
+			s.m = reactor::signal::mask::terminate;
 		} else {
-			throw exception::connection_establish {};
+			s.m = reactor::signal::mask::switch_protocols;
+			s.protocol_switch = group->pi->instantiate();
 		}
-		
 		return s;
 	}
 	virtual reactor::signal::mask::type default_mask() override { return reactor::signal::mask::wait_for_write; }
-	addrinfo * addr = nullptr;
-	std::shared_ptr<reactor::protocol_instantiator> pi;
+	std::shared_ptr<connect_group> group;
 };
 
+void reactor::connect_group::start(std::vector<resolved_address> const & addrs_in) {
+	std::unique_lock<std::mutex> lk {lock};
+	addrs = addrs_in;
+	if (!launch()) return fail(lk);
+	parent.schedule(cfg.connect_timeout, [g = shared_from_this()](){ g->expire(); });
+	if (next < addrs.size()) parent.schedule(cfg.stagger, [g = shared_from_this()](){ g->stagger(); });
+}
+
+void reactor::connect_group::stagger() {
+	std::unique_lock<std::mutex> lk {lock};
+	if (won || failed || next >= addrs.size()) return;
+	if (!launch()) {
+		if (!pending) fail(lk);
+		return;
+	}
+	if (next < addrs.size()) parent.schedule(cfg.stagger, [g = shared_from_this()](){ g->stagger(); });
+}
+
+void reactor::connect_group::expire() {
+	std::unique_lock<std::mutex> lk {lock};
+	if (failed || won.exchange(true)) return;
+	// attempts still pending see the group settled and terminate on their next event, the pulse at the latest
+	fail(lk);
+}
+
+void reactor::connect_group::attempt_failed() {
+	std::unique_lock<std::mutex> lk {lock};
+	pending--;
+	if (won || failed) return;
+	// an attempt that failed outright lets the next address start without waiting out the stagger
+	if (!launch() && !pending) fail(lk);
+}
+
+bool reactor::connect_group::launch() {
+	while (next < addrs.size()) {
+		resolved_address const & ra = addrs[next++];
+		parent.stats_data->connect_attempts.fetch_add(1, std::memory_order_relaxed);
+		socket sock;
+		sock.FD = ::socket(ra.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sock.FD == -1) continue;
+		if (::connect(sock.FD, reinterpret_cast<sockaddr const *>(&ra.addr), ra.len) == -1 && errno != EINPROGRESS) {
+			sock.close();
+			continue;
+		}
+		pending++;
+		parent.accept_connection(connection {std::move(sock)}, std::make_unique<connect_protocol>(shared_from_this()));
+		return true;
+	}
+	return false;
+}
+
+void reactor::connect_group::fail(std::unique_lock<std::mutex> & lk) {
+	failed = true;
+	lk.unlock();
+	parent.stats_data->connect_failed.fetch_add(1, std::memory_order_relaxed);
+	pi->connect_failed();
+}
+
 void reactor::connect(std::string const & host, std::string const & service, std::shared_ptr<protocol_instantiator> const & pi) {
+	std::string key = host + '\0' + service;
 	
-	std::unique_ptr<connection_protocol> cprot = std::make_unique<connection_protocol>();
-	cprot->pi = pi;
-	
-	static constexpr addrinfo hints = {
-		.ai_flags = 0,
-		.ai_family = AF_UNSPEC,
-		.ai_socktype = SOCK_STREAM,
-		.ai_protocol = 0,
-		.ai_addrlen = 0,
-		.ai_addr = nullptr,
-		.ai_canonname = nullptr,
-		.ai_next = nullptr
-	};
+	std::unique_lock<std::mutex> lk {resolver->lock};
+	std::shared_ptr<connect_group> group = std::make_shared<connect_group>(*this, pi, resolver->cfg);
+	auto c = resolver->cache.find(key);
+	if (c != resolver->cache.end() && c->second.expires > mono_ns()) {
+		std::vector<resolved_address> addrs = c->second.addrs;
+		lk.unlock();
+		stats_data->resolve_hits.fetch_add(1, std::memory_order_relaxed);
+		group->start(addrs);
+		return;
+	}
 	
-	socket sock;
+	auto & w = resolver->waiting[key];
+	w.push_back(group);
+	if (w.size() > 1) return;
+	resolver->jobs.push_back({host, service, key});
+	if (resolver->threads.empty()) {
+		for (unsigned int i = 0; i < std::max(1u, resolver->cfg.threads); i++) resolver->threads.emplace_back(&resolver_t::run, resolver.get());
+	}
+	lk.unlock();
+	resolver->cv.notify_one();
+}
+
+// ================================================================================================
+// CONNECTION POOL
+
+struct connection_pool::idle_conn {
+	int fd;
+	uint32_t generation;
+	uint64_t since;
+	bool listed = true;
+	reactor::protocol_instantiator_ptr handoff; // set under the pool lock by acquire, the connection is then woken to switch
+};
+
+struct connection_pool::host_entry {
+	std::string host, service;
+	size_t open = 0; // connecting, leased or idle
+	std::vector<std::shared_ptr<idle_conn>> idle; // most recently checked in last
+	std::deque<reactor::protocol_instantiator_ptr> waiting;
+};
+
+// shared with every pooled protocol so connections may outlive the pool object, host entries are never erased so pointers to them stay valid
+struct connection_pool::state : public std::enable_shared_from_this<state> {
+	state(reactor & r_, config const & cfg_) : r {r_}, cfg {cfg_} {}
+	reactor & r;
+	config const cfg;
+	std::mutex lock;
+	std::unordered_map<std::string, host_entry> hosts;
+	std::atomic_bool closed {false};
+	uint64_t connected = 0, reused = 0;
+	
+	void acquire(host_entry &, reactor::protocol_instantiator_ptr const &, std::unique_lock<std::mutex> &);
+	void lost(host_entry &); // a connection of this host closed or left the pool
+	void drop(host_entry &, std::shared_ptr<idle_conn> const &);
+	reactor::signal checkin(host_entry &, connection &, reactor::detail const &, reactor::signal);
+};
+
+struct connection_pool::pool_instantiator : public reactor::protocol_instantiator {
+	pool_instantiator(std::shared_ptr<state> const & st_, host_entry * h_, reactor::protocol_instantiator_ptr const & pi_) : st {st_}, h {h_}, pi {pi_} {}
+	virtual std::unique_ptr<reactor::protocol> instantiate() override;
+	virtual void connect_failed() override {
+		st->lost(*h);
+		pi->connect_failed();
+	}
+	std::shared_ptr<state> st;
+	host_entry * h;
+	reactor::protocol_instantiator_ptr pi;
+};
+
+struct connection_pool::lease_protocol : public reactor::protocol {
+	lease_protocol(std::shared_ptr<state> const & st_, host_entry * h_, std::unique_ptr<reactor::protocol> && inner_) : st {st_}, h {h_}, inner {std::move(inner_)} {}
+	~lease_protocol() {
+		if (!returned) st->lost(*h);
+	}
 	
-	int status = getaddrinfo(host.c_str(), service.c_str(), &hints, &cprot->addr);
-	if (status) throw exception::connection_resolve {};
+	virtual reactor::signal ready(connection & c, reactor::detail const & d) override;
+	virtual reactor::signal::mask::type default_mask() override { return inner->default_mask(); }
+	virtual void backpressure(bool engaged) override { inner->backpressure(engaged); }
 	
-	for (addrinfo * ai = cprot->addr; ai != nullptr; ai = ai->ai_next) {
-		if (ai->ai_family == AF_INET) sock.FD = ::socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-		else if (ai->ai_family == AF_INET6) sock.FD = ::socket(PF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
-		else continue;
+	std::shared_ptr<state> st;
+	host_entry * h;
+	std::unique_ptr<reactor::protocol> inner;
+	bool returned = false;
+};
+
+struct connection_pool::idle_protocol : public reactor::protocol {
+	~idle_protocol() {
+		if (st && !settled) st->drop(*h, ic);
+	}
+	
+	virtual reactor::signal ready(connection & c, reactor::detail const & d) override {
+		reactor::signal s;
+		if (!st) {
+			s.m = reactor::signal::mask::terminate; // checked in outside of a pool
+			return s;
+		}
+		
+		if (d.ready_reason & reactor::reason::wake) {
+			reactor::protocol_instantiator_ptr pi;
+			{
+				std::lock_guard<std::mutex> lk {st->lock};
+				pi = std::move(ic->handoff);
+			}
+			if (pi) {
+				settled = true;
+				s.m = reactor::signal::mask::switch_protocols;
+				s.protocol_switch = std::make_unique<lease_protocol>(st, h, pi->instantiate());
+				return s;
+			}
+		}
 		
-		status = ::connect(sock.FD, ai->ai_addr, ai->ai_addrlen);
-		if (status == -1 && errno != EINPROGRESS) {
-			throw exception::connection_resolve {};
+		// an idle connection should never become readable, either the peer closed it or sent something nobody asked for
+		bool healthy = true;
+		if (d.ready_reason & (reactor::reason::read_available | reactor::reason::error)) {
+			char b;
+			healthy = recv(c.FD, &b, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
 		}
-		break;
+		if (healthy && d.ready_reason & reactor::reason::pulse) {
+			std::chrono::nanoseconds idle_for { mono_ns() - ic->since };
+			if (st->closed || idle_for > st->cfg.idle_timeout) healthy = false;
+			else if (st->cfg.health_check && !st->cfg.health_check(c)) healthy = false;
+		}
+		
+		if (healthy) {
+			s.m = reactor::signal::mask::wait_for_read;
+			return s;
+		}
+		settled = true;
+		st->drop(*h, ic);
+		s.m = reactor::signal::mask::terminate;
+		return s;
 	}
+	virtual reactor::signal::mask::type default_mask() override { return reactor::signal::mask::wait_for_read; }
 	
-	accept_connection(std::move(sock), std::move(cprot));
+	std::shared_ptr<state> st;
+	host_entry * h = nullptr;
+	std::shared_ptr<idle_conn> ic;
+	bool settled = false;
+};
+
+reactor::signal connection_pool::lease_protocol::ready(connection & c, reactor::detail const & d) {
+	if (!inner->set_mask) inner->set_mask = set_mask;
+	reactor::signal s = inner->ready(c, d);
+	if (!(s.m & reactor::signal::mask::switch_protocols) || !dynamic_cast<idle_protocol *>(s.protocol_switch.get())) return s;
+	returned = true;
+	return st->checkin(*h, c, d, std::move(s));
+}
+
+std::unique_ptr<reactor::protocol> connection_pool::pool_instantiator::instantiate() {
+	return std::make_unique<lease_protocol>(st, h, pi->instantiate());
+}
+
+void connection_pool::state::acquire(host_entry & h, reactor::protocol_instantiator_ptr const & pi, std::unique_lock<std::mutex> & lk) {
+	if (!h.idle.empty()) {
+		std::shared_ptr<idle_conn> ic = std::move(h.idle.back());
+		h.idle.pop_back();
+		ic->listed = false;
+		ic->handoff = pi;
+		reused++;
+		lk.unlock();
+		r.wake(ic->fd, ic->generation);
+		return;
+	}
+	if (h.open < cfg.max_per_host) {
+		h.open++;
+		connected++;
+		lk.unlock();
+		r.connect(h.host, h.service, std::make_shared<pool_instantiator>(shared_from_this(), &h, pi));
+		return;
+	}
+	h.waiting.push_back(pi);
+	lk.unlock();
+}
+
+void connection_pool::state::lost(host_entry & h) {
+	std::unique_lock<std::mutex> lk {lock};
+	h.open--;
+	if (closed || h.waiting.empty()) return;
+	reactor::protocol_instantiator_ptr pi = std::move(h.waiting.front());
+	h.waiting.pop_front();
+	lk.unlock();
+	// connecting from here could run inside the reactor's teardown, the master picks it up instead
+	r.schedule(std::chrono::milliseconds {0}, [st = shared_from_this(), hp = &h, pi](){
+		std::unique_lock<std::mutex> lk {st->lock};
+		st->acquire(*hp, pi, lk);
+	});
+}
+
+void connection_pool::state::drop(host_entry & h, std::shared_ptr<idle_conn> const & ic) {
+	{
+		std::lock_guard<std::mutex> lk {lock};
+		if (ic->listed) {
+			h.idle.erase(std::find(h.idle.begin(), h.idle.end(), ic));
+			ic->listed = false;
+		} else if (ic->handoff) {
+			h.waiting.push_front(std::move(ic->handoff)); // acquired while dying, the acquire goes first in line for a replacement
+		}
+	}
+	lost(h);
+}
+
+reactor::signal connection_pool::state::checkin(host_entry & h, connection & c, reactor::detail const & d, reactor::signal s) {
+	std::unique_lock<std::mutex> lk {lock};
+	if (!closed && !h.waiting.empty()) {
+		reactor::protocol_instantiator_ptr pi = std::move(h.waiting.front());
+		h.waiting.pop_front();
+		reused++;
+		lk.unlock();
+		s.protocol_switch = std::make_unique<lease_protocol>(shared_from_this(), &h, pi->instantiate());
+		return s;
+	}
+	if (closed || h.idle.size() >= cfg.max_idle || c.queued()) {
+		h.open--;
+		s.m = reactor::signal::mask::terminate;
+		s.protocol_switch.reset();
+		return s;
+	}
+	std::shared_ptr<idle_conn> ic = std::make_shared<idle_conn>();
+	ic->fd = c.FD;
+	ic->generation = d.generation;
+	ic->since = mono_ns();
+	h.idle.push_back(ic);
+	idle_protocol * ip = static_cast<idle_protocol *>(s.protocol_switch.get());
+	ip->st = shared_from_this();
+	ip->h = &h;
+	ip->ic = std::move(ic);
+	return s;
+}
+
+connection_pool::connection_pool(reactor & r) : st {std::make_shared<state>(r, config {})} {}
+connection_pool::connection_pool(reactor & r, config const & cfg) : st {std::make_shared<state>(r, cfg)} {}
+
+connection_pool::~connection_pool() {
+	std::deque<reactor::protocol_instantiator_ptr> waiting;
+	{
+		std::lock_guard<std::mutex> lk {st->lock};
+		st->closed = true;
+		for (auto & h : st->hosts) {
+			for (auto & w : h.second.waiting) waiting.push_back(std::move(w));
+			h.second.waiting.clear();
+		}
+	}
+	for (auto & w : waiting) w->connect_failed();
+}
+
+void connection_pool::acquire(std::string const & host, std::string const & service, reactor::protocol_instantiator_ptr const & pi) {
+	std::unique_lock<std::mutex> lk {st->lock};
+	host_entry & h = st->hosts[host + ':' + service];
+	if (h.host.empty()) {
+		h.host = host;
+		h.service = service;
+	}
+	st->acquire(h, pi, lk);
+}
+
+std::unique_ptr<reactor::protocol> connection_pool::checkin() {
+	return std::make_unique<idle_protocol>();
+}
+
+asterales::aeon::object connection_pool::stats() const {
+	namespace aeon = asterales::aeon;
+	aeon::object ret = aeon::map();
+	std::lock_guard<std::mutex> lk {st->lock};
+	ret["connected"] = st->connected;
+	ret["reused"] = st->reused;
+	aeon::object & hosts = ret["hosts"] = aeon::map();
+	for (auto const & h : st->hosts) {
+		aeon::object & ho = hosts[h.first] = aeon::map();
+		ho["open"] = h.second.open;
+		ho["idle"] = h.second.idle.size();
+		ho["waiting"] = h.second.waiting.size();
+	}
+	return ret;
+}
+
+// ================================================================================================
+// FRAMED PROTOCOL
+
+#define VARINT_MAX_BYTES 10
+
+// decodes a LEB128 prefix without consuming it, 0 while incomplete, -1 if malformed
+static int peek_varint(asterales::buffer_assembly const & buf, uint64_t & v) {
+	v = 0;
+	for (size_t i = 0; i < VARINT_MAX_BYTES; i++) {
+		if (i >= buf.size()) return 0;
+		v |= static_cast<uint64_t>(buf[i] & 0x7F) << (7 * i);
+		if (!(buf[i] & 0x80)) return i + 1;
+	}
+	return -1;
+}
+
+static size_t varint_size(uint64_t v) {
+	size_t n = 1;
+	while (v >>= 7) n++;
+	return n;
+}
+
+void framed_protocol::send(aeon::object const & obj) {
+	// serialize behind a one byte prefix, which covers small frames, and shift the payload only when the length needs more
+	size_t mark = out.size();
+	out.write(uint8_t {0});
+	obj.serialize_binary(out);
+	uint64_t len = out.size() - mark - 1;
+	size_t prefix = varint_size(len);
+	if (prefix > 1) {
+		out.prepare(prefix - 1);
+		out.commit(prefix - 1);
+		memmove(out.data() + mark + prefix, out.data() + mark + 1, len);
+	}
+	asterales::buffer_assembly::byte_t * p = out.data() + mark;
+	for (size_t i = 0; i < prefix; i++, len >>= 7) p[i] = (len & 0x7F) | (i + 1 < prefix ? 0x80 : 0);
+}
+
+reactor::signal framed_protocol::ready(connection & con, reactor::detail const & d) {
+	reactor::signal s;
+	// frames already buffered are still decoded while throttled, only pulling more from the peer waits
+	bool hangup = d.ready_reason & reactor::reason::read_available && !throttled && con.read(in) < 0;
+	
+	while (!closing) {
+		uint64_t len;
+		int prefix = peek_varint(in, len);
+		if (prefix == 0) break;
+		if (prefix < 0 || len > max_frame) {
+			closing = true;
+			break;
+		}
+		if (in.size() < prefix + len) break;
+		in.discard(prefix);
+		// parsed in place, an object that ends anywhere but the frame's end is malformed, lengths inside it are checked against what is buffered before anything is allocated
+		size_t expect = in.size() - len;
+		try {
+			aeon::object obj = aeon::parse_binary(in);
+			if (in.size() != expect) throw aeon::exception::parse {}; // the object and its prefix disagree
+			frame(con, std::move(obj));
+		} catch (aeon::exception::parse const &) {
+			closing = true;
+		} catch (std::bad_alloc const &) {
+			closing = true;
+		}
+	}
+	
+	if (out.size()) {
+		con.queue(std::move(out));
+		out = asterales::buffer_assembly {};
+	}
+	if (hangup || closing) {
+		closed();
+		s.m = reactor::signal::mask::terminate;
+	} else s.m = reactor::signal::mask::wait_for_read;
+	return s;
+}
+
+// ================================================================================================
+// FIBER PROTOCOL
+
+struct fiber_protocol::context {
+	ucontext_t fiber, caller;
+	void * stack = nullptr;
+	size_t stack_size;
+	size_t guard_size;
+	std::unique_ptr<fiber_io> io;
+	bool started = false, done = false, cancelled = false;
+	reactor::signal::mask::type want = 0;
+	std::exception_ptr error;
+};
+
+fiber_protocol::fiber_protocol(size_t stack_size) : ctx {new context} {
+	size_t page = sysconf(_SC_PAGESIZE);
+	ctx->guard_size = page;
+	ctx->stack_size = (stack_size + page - 1) / page * page;
+	// the lowest page stays inaccessible so an overflow faults instead of silently corrupting the heap
+	ctx->stack = mmap(nullptr, ctx->stack_size + ctx->guard_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (ctx->stack == MAP_FAILED) throw exception::fiber_stack {};
+	mprotect(ctx->stack, ctx->guard_size, PROT_NONE);
+}
+
+fiber_protocol::~fiber_protocol() {
+	if (ctx->started && !ctx->done) {
+		ctx->cancelled = true;
+		resume();
+	}
+	munmap(ctx->stack, ctx->stack_size + ctx->guard_size);
+}
+
+void fiber_protocol::trampoline(unsigned int hi, unsigned int lo) {
+	fiber_protocol * self = reinterpret_cast<fiber_protocol *>((static_cast<uintptr_t>(hi) << 32) | lo);
+	try {
+		self->run(*self->ctx->io);
+	} catch (exception::fiber_cancel const &) {
+	} catch (...) {
+		self->ctx->error = std::current_exception();
+	}
+	self->ctx->done = true;
+	// returning follows uc_link back to whichever thread resumed the fiber last
+}
+
+void fiber_protocol::resume() {
+	swapcontext(&ctx->caller, &ctx->fiber);
+}
+
+reactor::signal fiber_protocol::ready(connection & con, reactor::detail const &) {
+	reactor::signal s;
+	if (!ctx->started) {
+		ctx->started = true;
+		ctx->io.reset(new fiber_io {*this, con});
+		getcontext(&ctx->fiber);
+		ctx->fiber.uc_stack.ss_sp = static_cast<char *>(ctx->stack) + ctx->guard_size;
+		ctx->fiber.uc_stack.ss_size = ctx->stack_size;
+		ctx->fiber.uc_link = &ctx->caller;
+		uintptr_t self = reinterpret_cast<uintptr_t>(this);
+		makecontext(&ctx->fiber, reinterpret_cast<void (*)()>(&fiber_protocol::trampoline), 2, static_cast<unsigned int>(self >> 32), static_cast<unsigned int>(self));
+	}
+	resume();
+	if (ctx->error) std::rethrow_exception(ctx->error);
+	s.m = ctx->done ? reactor::signal::mask::terminate : ctx->want;
+	return s;
+}
+
+void fiber_io::wait(reactor::signal::mask::type m) {
+	fiber_protocol::context & ctx = *proto.ctx;
+	if (ctx.cancelled) throw exception::fiber_cancel {};
+	ctx.want = m;
+	swapcontext(&ctx.fiber, &ctx.caller);
+	if (ctx.cancelled) throw exception::fiber_cancel {};
+}
+
+bool fiber_io::read(buffer_assembly & buf, size_t n) {
+	while (buf.size() < n) {
+		ssize_t e = con.read(buf, n - buf.size());
+		if (e < 0) return false;
+		if (buf.size() < n) wait(reactor::signal::mask::wait_for_read);
+	}
+	return true;
+}
+
+bool fiber_io::read_some(buffer_assembly & buf) {
+	while (true) {
+		ssize_t e = con.read(buf);
+		if (e < 0) return false;
+		if (e > 0) return true;
+		wait(reactor::signal::mask::wait_for_read);
+	}
+}
+
+bool fiber_io::write(buffer_assembly && buf) {
+	con.queue(std::move(buf));
+	while (con.queued()) {
+		if (con.flush() < 0) return false;
+		if (con.queued()) wait(reactor::signal::mask::wait_for_write);
+	}
+	return true;
+}
+
+bool fiber_io::write(buffer_assembly const & buf) {
+	return write(buffer_assembly {buf});
+}
+
+// ================================================================================================
+// HANDOFF
+
+#define HANDOFF_MAX_FDS 64
+
+bool handoff::send(int unix_fd, std::vector<int> const & fds) {
+	if (fds.empty() || fds.size() > HANDOFF_MAX_FDS) return false;
+	uint32_t count = fds.size();
+	iovec iov { &count, sizeof(count) };
+	std::vector<char> control (CMSG_SPACE(sizeof(int) * fds.size()));
+	msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+	cmsghdr * cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+	memcpy(CMSG_DATA(cm), fds.data(), sizeof(int) * fds.size());
+	return sendmsg(unix_fd, &msg, MSG_NOSIGNAL) == sizeof(count);
+}
+
+std::vector<int> handoff::receive(int unix_fd) {
+	std::vector<int> ret;
+	uint32_t count = 0;
+	iovec iov { &count, sizeof(count) };
+	char control [CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+	msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(unix_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(count)) return ret;
+	for (cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+		size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		size_t at = ret.size();
+		ret.resize(at + n);
+		memcpy(ret.data() + at, CMSG_DATA(cm), n * sizeof(int));
+	}
+	if (ret.size() != count) {
+		for (int fd : ret) ::close(fd);
+		ret.clear();
+	}
+	return ret;
+}
+
+static bool unix_address(std::string const & path, sockaddr_un & addr) {
+	addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) return false;
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+bool handoff::serve(std::string const & path, std::vector<int> const & fds, std::chrono::milliseconds timeout) {
+	sockaddr_un addr;
+	if (!unix_address(path, addr)) return false;
+	int srv = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (srv == -1) return false;
+	unlink(path.c_str());
+	bool ok = false;
+	if (!bind(srv, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) && !::listen(srv, 1)) {
+		pollfd pfd { srv, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout.count()) == 1) {
+			int peer = accept4(srv, nullptr, nullptr, SOCK_CLOEXEC);
+			if (peer != -1) {
+				ok = handoff::send(peer, fds);
+				::close(peer);
+			}
+		}
+	}
+	::close(srv);
+	unlink(path.c_str());
+	return ok;
+}
+
+std::vector<int> handoff::fetch(std::string const & path, std::chrono::milliseconds timeout) {
+	sockaddr_un addr;
+	if (!unix_address(path, addr)) return {};
+	auto until = std::chrono::steady_clock::now() + timeout;
+	while (true) {
+		int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1) return {};
+		if (!::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+			std::vector<int> ret = handoff::receive(fd);
+			::close(fd);
+			return ret;
+		}
+		::close(fd);
+		// the serving side may not have bound the path yet
+		if (std::chrono::steady_clock::now() >= until) return {};
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
 }
@@ -1,38 +1,431 @@
 #include "asterales/threadpool.hh"
 
-asterales::thread_pool::thread_pool(size_t pool_size) {
-	for (size_t i = 0; i < pool_size; i++) {
-		threads.emplace_back(&thread_pool::thread_run, this);
-	}
+#define DEQUE_INITIAL_CAPACITY 64
+
+// idle threads scan for work this many times, pausing in between, before parking
+#define IDLE_SPIN_ROUNDS 32
+#define IDLE_SPIN_PAUSES 64
+// growth is considered at most this often, and only while queued tasks outnumber running threads
+#define GROW_INTERVAL_NS 1000000
+
+// out of this many picks, one searches the normal lane first, and one of this many the background lane
+#define LANE_NORMAL_SHARE 4
+#define LANE_BACKGROUND_SHARE 16
+
+static inline int64_t steady_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+asterales::task_deque::task_deque() : ring {new entry [DEQUE_INITIAL_CAPACITY]}, capacity {DEQUE_INITIAL_CAPACITY} {}
+
+asterales::task_deque::~task_deque() {
+	delete [] ring;
+}
+
+void asterales::task_deque::grow() {
+	entry * bigger = new entry [capacity << 1];
+	for (size_t i = 0; i < count; i++) bigger[i] = std::move(ring[(head + i) & (capacity - 1)]);
+	delete [] ring;
+	ring = bigger;
+	capacity <<= 1;
+	head = 0;
+}
+
+void asterales::task_deque::push_back(task && t, int64_t queued) {
+	std::lock_guard<spinlock> lk {lock};
+	if (count == capacity) grow();
+	entry & e = ring[(head + count++) & (capacity - 1)];
+	e.t = std::move(t);
+	e.queued = queued;
+	count_hint.store(count, std::memory_order_relaxed);
+}
+
+bool asterales::task_deque::pop_back(task & out, int64_t & queued) {
+	if (!count_hint.load(std::memory_order_relaxed)) return false;
+	std::lock_guard<spinlock> lk {lock};
+	if (!count) return false;
+	entry & e = ring[(head + --count) & (capacity - 1)];
+	out = std::move(e.t);
+	queued = e.queued;
+	count_hint.store(count, std::memory_order_relaxed);
+	return true;
+}
+
+bool asterales::task_deque::pop_front(task & out, int64_t & queued) {
+	if (!count_hint.load(std::memory_order_relaxed)) return false;
+	std::lock_guard<spinlock> lk {lock};
+	if (!count) return false;
+	entry & e = ring[head];
+	out = std::move(e.t);
+	queued = e.queued;
+	head = (head + 1) & (capacity - 1);
+	count--;
+	count_hint.store(count, std::memory_order_relaxed);
+	return true;
+}
+
+// ================================================================================================
+
+struct asterales::thread_pool::lane_counters {
+	std::atomic_uint64_t executed {0}, dropped {0}, wait_total_ns {0}, wait_max_ns {0};
+};
+
+struct asterales::thread_pool::worker {
+	worker(thread_pool & p, size_t i) : pool {p}, index {i}, rng {static_cast<uint32_t>(i * 2654435761u + 1)} {}
+	thread_pool & pool;
+	size_t index;
+	uint32_t rng;
+	uint32_t tick = 0;
+	priority running = priority::normal; // lane of the task being run, inherited by what it submits
+	task_deque local [lanes];
+	lane_counters counters [lanes];
+	std::atomic_bool active {false}; // a thread runs in this slot
+	std::thread thread;
+};
+
+thread_local asterales::thread_pool::worker * asterales::thread_pool::current_worker = nullptr;
+
+asterales::thread_pool::thread_pool(size_t pool_size) : thread_pool(pool_size, pool_size) {}
+
+asterales::thread_pool::thread_pool(size_t min_t, size_t max_t) : external {new lane_counters [lanes]} {
+	max_threads = std::max<size_t>(max_t, 1);
+	min_threads = std::min(std::max<size_t>(min_t, 1), max_threads);
+	for (size_t i = 0; i < max_threads * 2; i++) workers.emplace_back(new worker {*this, i});
+	std::lock_guard<std::mutex> lk {resize_m};
+	for (size_t i = 0; i < min_threads; i++) spawn();
 }
 
 asterales::thread_pool::~thread_pool() {
-	run_sem.store(false);
-	queue_cv.notify_all();
-	for (std::thread & th : threads) {
-		if (th.joinable()) th.join();
+	{
+		std::lock_guard<std::mutex> lk {resize_m};
+		run_sem.store(false); // no thread is spawned after this, so the slots' threads can be joined without the lock
+	}
+	wake_epoch.fetch_add(1);
+	futex_wake(wake_epoch, INT32_MAX);
+	for (auto & w : workers) {
+		if (w->thread.joinable()) w->thread.join();
 	}
 }
 
-void asterales::thread_pool::enqueue(std::unique_ptr<task_base> && task) {
-	std::unique_lock lk {queue_m};
-	task_queue.push(std::forward<std::unique_ptr<task_base> &&>(task));
-	queue_cv.notify_one();
+// resize_m must be held
+bool asterales::thread_pool::spawn() {
+	if (!run_sem) return false;
+	for (size_t i = 0; i < workers.size(); i++) {
+		worker & w = *workers[i];
+		if (w.active.load(std::memory_order_acquire)) continue;
+		if (w.thread.joinable()) w.thread.join(); // retired, it clears active as the last thing it does
+		w.active.store(true, std::memory_order_relaxed);
+		live.fetch_add(1);
+		if (slots_used.load(std::memory_order_relaxed) <= i) slots_used.store(i + 1, std::memory_order_release);
+		w.thread = std::thread { &thread_pool::thread_run, this, std::ref(w) };
+		if (placement) topology::pin(w.thread, placement->assign(i));
+		return true;
+	}
+	return false;
+}
+
+void asterales::thread_pool::maybe_grow(int64_t now) {
+	int64_t last = last_grow.load(std::memory_order_relaxed);
+	if (now - last < GROW_INTERVAL_NS || !last_grow.compare_exchange_strong(last, now, std::memory_order_relaxed)) return;
+	size_t running = live.load(), stuck = blocked.load(), limit = max_threads + stuck;
+	if (running >= limit) return;
+	size_t queued = 0, used = slots_used.load(std::memory_order_acquire);
+	for (size_t l = 0; l < lanes; l++) {
+		queued += injection[l].size();
+		for (size_t i = 0; i < used; i++) queued += workers[i]->local[l].size();
+	}
+	if (queued <= running - std::min(running, stuck)) return; // blocked threads take nothing off the queues
+	std::unique_lock<std::mutex> lk {resize_m, std::try_to_lock};
+	if (lk && live.load() < limit) spawn();
+}
+
+// a thread leaves once idle past the idle timeout while above the minimum, or right away while above the maximum once blocking compensation is no longer needed
+bool asterales::thread_pool::retire(worker & w, bool idle_expired) {
+	size_t running = live.load();
+	while (true) {
+		size_t floor = (idle_expired ? min_threads : max_threads) + blocked.load();
+		if (running <= floor) return false;
+		if (live.compare_exchange_weak(running, running - 1)) break;
+	}
+	w.active.store(false, std::memory_order_release);
+	return true;
+}
+
+bool asterales::thread_pool::begin_blocking() {
+	worker * w = current_worker;
+	if (!w || &w->pool != this) return false;
+	blocked.fetch_add(1);
+	// an idle thread picks up what this one leaves, and if work queues up behind busy ones later maybe_grow still counts this thread as blocked
+	auto short_handed = [this](){ return !idle.load() && live.load() < max_threads + blocked.load(); };
+	if (!short_handed()) return true;
+	std::lock_guard<std::mutex> lk {resize_m};
+	if (short_handed()) spawn(); // rechecked, a concurrent blocker may have covered for both
+	return true;
+}
+
+void asterales::thread_pool::end_blocking() {
+	blocked.fetch_sub(1);
+}
+
+void asterales::thread_pool::enqueue(std::unique_ptr<task_base> && t) {
+	push(task {[t = std::move(t)](){ t->execute(); }}, lane_for({}));
+}
+
+void asterales::thread_pool::push(task && t, priority lane) {
+	size_t l = static_cast<size_t>(lane);
+	worker * w = current_worker;
+	int64_t now = steady_ns();
+	if (w && &w->pool == this) w->local[l].push_back(std::move(t), now);
+	else injection[l].push_back(std::move(t), now);
+	notify();
+	if (!idle.load(std::memory_order_relaxed) && (min_threads < max_threads || blocked.load(std::memory_order_relaxed))) maybe_grow(now);
+}
+
+void asterales::thread_pool::notify() {
+	// pairs with the fence in thread_run, either a sleeper's recheck sees the task or this sees the sleeper and bumps the epoch it waits on
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!sleepers.load(std::memory_order_relaxed)) return;
+	wake_epoch.fetch_add(1);
+	futex_wake(wake_epoch, 1);
+}
+
+asterales::priority asterales::thread_pool::lane_for(task_options const & opt) const {
+	if (opt.lane) return *opt.lane;
+	worker * w = current_worker;
+	if (w && &w->pool == this) return w->running;
+	return priority::normal;
+}
+
+bool asterales::thread_pool::expired(task_options::time_point deadline, cancel_token const & token) {
+	if (token.cancelled()) return true;
+	return deadline != task_options::time_point::max() && std::chrono::steady_clock::now() > deadline;
+}
+
+void asterales::thread_pool::dropped(priority lane) {
+	worker * w = current_worker;
+	lane_counters * c = w && &w->pool == this ? w->counters : external.get();
+	c[static_cast<size_t>(lane)].dropped.fetch_add(1, std::memory_order_relaxed);
 }
 
-void asterales::thread_pool::thread_run() {
-	while (run_sem) {
-		{
-			std::unique_lock lk {cv_m};
-			queue_cv.wait_for(lk, std::chrono::milliseconds(5000));
+asterales::thread_pool::lane_stats asterales::thread_pool::stats(priority lane) const {
+	size_t l = static_cast<size_t>(lane);
+	lane_stats ret;
+	auto add = [&ret](lane_counters const & c){
+		ret.executed += c.executed.load(std::memory_order_relaxed);
+		ret.dropped += c.dropped.load(std::memory_order_relaxed);
+		ret.wait_total_ns += c.wait_total_ns.load(std::memory_order_relaxed);
+		ret.wait_max_ns = std::max<uint64_t>(ret.wait_max_ns, c.wait_max_ns.load(std::memory_order_relaxed));
+	};
+	for (auto const & w : workers) add(w->counters[l]);
+	add(external[l]);
+	return ret;
+}
+
+void asterales::thread_pool::set_placement(topology::placement const & pl) {
+	std::lock_guard<std::mutex> lk {resize_m};
+	placement.reset(new topology::placement {pl});
+	std::vector<topology::placement::slot> plan = pl.plan(workers.size());
+	for (size_t i = 0; i < workers.size(); i++) {
+		if (workers[i]->active.load()) topology::pin(workers[i]->thread, plan[i].cpus);
+	}
+}
+
+bool asterales::thread_pool::find_work(worker * w, uint32_t & rng, task & out, priority & lane, int64_t & queued) {
+	static thread_local uint32_t outside_tick = 0;
+	uint32_t tick = ++(w ? w->tick : outside_tick);
+	size_t first = 0;
+	if (tick % LANE_BACKGROUND_SHARE == 0) first = 2;
+	else if (tick % LANE_NORMAL_SHARE == 0) first = 1;
+	for (size_t i = 0; i < lanes; i++) {
+		size_t l = (first + i) % lanes;
+		if ((w && w->local[l].pop_back(out, queued)) || injection[l].pop_front(out, queued) || steal(rng, w, l, out, queued)) {
+			lane = static_cast<priority>(l);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool asterales::thread_pool::steal(uint32_t & rng, worker const * self, size_t lane, task & out, int64_t & queued) {
+	size_t n = slots_used.load(std::memory_order_acquire);
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	size_t start = rng % n;
+	for (size_t i = 0; i < n; i++) {
+		worker & victim = *workers[(start + i) % n];
+		if (&victim == self) continue;
+		if (victim.local[lane].pop_front(out, queued)) return true;
+	}
+	return false;
+}
+
+void asterales::thread_pool::execute(task & t, priority lane, int64_t queued, lane_counters & c) {
+	int64_t now = steady_ns();
+	uint64_t waited = std::max<int64_t>(0, now - queued);
+	if (!idle.load(std::memory_order_relaxed) && (min_threads < max_threads || blocked.load(std::memory_order_relaxed))) maybe_grow(now); // a backlog that was queued all at once is only noticed as it drains
+	worker * w = current_worker;
+	if (w && &w->pool == this) {
+		// only this thread writes its own counters, so plain stores do and stats() just reads them
+		c.executed.store(c.executed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		c.wait_total_ns.store(c.wait_total_ns.load(std::memory_order_relaxed) + waited, std::memory_order_relaxed);
+		if (waited > c.wait_max_ns.load(std::memory_order_relaxed)) c.wait_max_ns.store(waited, std::memory_order_relaxed);
+	} else {
+		c.executed.fetch_add(1, std::memory_order_relaxed);
+		c.wait_total_ns.fetch_add(waited, std::memory_order_relaxed);
+		uint64_t max = c.wait_max_ns.load(std::memory_order_relaxed);
+		while (waited > max && !c.wait_max_ns.compare_exchange_weak(max, waited, std::memory_order_relaxed));
+	}
+	
+	priority outer = priority::normal;
+	if (w && &w->pool == this) {
+		outer = w->running;
+		w->running = lane;
+	}
+	try {
+		t();
+	} catch (...) {} // posted tasks have nowhere to report to
+	t.reset();
+	if (w && &w->pool == this) w->running = outer;
+}
+
+bool asterales::thread_pool::run_one() {
+	static thread_local uint32_t rng = 0x9E3779B9u;
+	task t;
+	priority lane;
+	int64_t queued;
+	worker * w = current_worker;
+	if (w && &w->pool == this) {
+		if (!find_work(w, w->rng, t, lane, queued)) return false;
+		execute(t, lane, queued, w->counters[static_cast<size_t>(lane)]);
+	} else {
+		if (!find_work(nullptr, rng, t, lane, queued)) return false;
+		execute(t, lane, queued, external[static_cast<size_t>(lane)]);
+	}
+	return true;
+}
+
+asterales::thread_pool * asterales::thread_pool::current() {
+	return current_worker ? &current_worker->pool : nullptr;
+}
+
+// ================================================================================================
+
+asterales::task_graph::node asterales::task_graph::add(task && fn) {
+	nodes.emplace_back(new node_t);
+	nodes.back()->fn = std::move(fn);
+	return nodes.size() - 1;
+}
+
+void asterales::task_graph::precede(node before, node after) {
+	nodes[before]->successors.push_back(after);
+	nodes[after]->predecessors++;
+}
+
+asterales::task_future<void> asterales::task_graph::run(thread_pool & pool) {
+	out = task_state<void>::acquire();
+	task_future<void> ret {out};
+	if (nodes.empty()) {
+		out->set_value(true);
+		out->release();
+		return ret;
+	}
+	remaining.store(nodes.size());
+	failed.store(false);
+	error = nullptr;
+	for (auto & n : nodes) n->waiting.store(n->predecessors, std::memory_order_relaxed);
+	for (node i = 0; i < nodes.size(); i++) {
+		if (!nodes[i]->predecessors) pool.post([this, &pool, i](){ run_node(pool, i); });
+	}
+	return ret;
+}
+
+void asterales::task_graph::run_node(thread_pool & pool, node i) {
+	node_t & n = *nodes[i];
+	if (!failed.load(std::memory_order_acquire)) {
+		try {
+			n.fn();
+		} catch (...) {
+			std::lock_guard<spinlock> lk {error_lock};
+			if (!error) error = std::current_exception();
+			failed.store(true, std::memory_order_release);
+		}
+	}
+	for (node s : n.successors) {
+		if (nodes[s]->waiting.fetch_sub(1, std::memory_order_acq_rel) == 1) pool.post([this, &pool, s](){ run_node(pool, s); });
+	}
+	if (remaining.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+	task_state<void> * st = out;
+	if (error) st->set_exception(error);
+	else st->set_value(true);
+	st->release();
+}
+
+// ================================================================================================
+
+void asterales::fork_join::fail(std::exception_ptr e) {
+	std::lock_guard<spinlock> lk {error_lock};
+	if (!error) error = e;
+	failed.store(true, std::memory_order_relaxed);
+}
+
+void asterales::fork_join::finish() {
+	// join may return and take this fork_join with it as soon as the count drops, the wake is then at worst spurious for whatever reuses the address
+	if (pending.fetch_sub(1, std::memory_order_acq_rel) == (parked | 1)) futex_wake(pending, 1);
+}
+
+void asterales::fork_join::join(thread_pool & pool) {
+	if (!pool.help_until([this](){ return !pending.load(std::memory_order_acquire); })) {
+		// the subtasks left are running elsewhere or wait on something outside the pool
+		pool.blocking([this](){
+			uint32_t s = pending.fetch_or(parked, std::memory_order_acq_rel) | parked;
+			while (s != parked) {
+				futex_wait(pending, s);
+				s = pending.load(std::memory_order_acquire);
+			}
+			pending.store(0, std::memory_order_relaxed);
+		});
+	}
+	if (error) std::rethrow_exception(error);
+}
+
+void asterales::thread_pool::thread_run(worker & w) {
+	current_worker = &w;
+	task t;
+	priority lane;
+	int64_t queued;
+	while (true) {
+		if (find_work(&w, w.rng, t, lane, queued)) {
+			execute(t, lane, queued, w.counters[static_cast<size_t>(lane)]);
+			continue;
+		}
+		if (!run_sem) break;
+		if (retire(w, false)) return;
+		
+		idle.fetch_add(1, std::memory_order_relaxed);
+		bool found = false, expired = false;
+		for (size_t round = 0; round < IDLE_SPIN_ROUNDS && !found; round++) {
+			for (size_t i = 0; i < IDLE_SPIN_PAUSES; i++) __asm volatile ("pause" ::: "memory");
+			found = find_work(&w, w.rng, t, lane, queued);
+		}
+		if (!found) {
+			uint32_t epoch = wake_epoch.load();
+			sleepers.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			found = find_work(&w, w.rng, t, lane, queued);
+			// sleepers stays raised until after the wait so producers know to bump the epoch
+			if (!found && run_sem) {
+				if (live.load() > min_threads + blocked.load()) expired = !futex_wait(wake_epoch, epoch, std::chrono::milliseconds {idle_timeout.load(std::memory_order_relaxed)});
+				else futex_wait(wake_epoch, epoch);
+			}
+			sleepers.fetch_sub(1);
 		}
-		{
-			std::unique_lock lk {queue_m};
-			if (task_queue.empty()) continue;
-			auto task = std::move(task_queue.front());
-			task_queue.pop();
-			lk.unlock();
-			task->execute();
+		idle.fetch_sub(1, std::memory_order_relaxed);
+		if (!found && expired) {
+			found = find_work(&w, w.rng, t, lane, queued);
+			if (!found && retire(w, true)) return;
 		}
+		if (found) execute(t, lane, queued, w.counters[static_cast<size_t>(lane)]);
 	}
+	current_worker = nullptr;
 }
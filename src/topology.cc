@@ -0,0 +1,209 @@
+#include "asterales/topology.hh"
+
+#include <algorithm>
+#include <fstream>
+
+#include <pthread.h>
+#include <sched.h>
+
+using namespace asterales::topology;
+
+#define SYS_CPU "/sys/devices/system/cpu/"
+#define SYS_NODE "/sys/devices/system/node/"
+
+static bool read_line(std::string const & path, std::string & out) {
+	std::ifstream f {path};
+	if (!f) return false;
+	std::getline(f, out);
+	return true;
+}
+
+static bool to_uint(std::string const & str, unsigned int & out) {
+	try {
+		out = std::stoul(str);
+		return true;
+	} catch (...) {
+		return false;
+	}
+}
+
+std::vector<unsigned int> asterales::topology::parse_list(std::string const & str) {
+	std::vector<unsigned int> ret;
+	size_t i = 0;
+	while (i < str.size()) {
+		size_t end = str.find(',', i);
+		if (end == std::string::npos) end = str.size();
+		std::string part = str.substr(i, end - i);
+		size_t dash = part.find('-');
+		unsigned int a, b;
+		if (dash == std::string::npos) {
+			if (to_uint(part, a)) ret.push_back(a);
+		} else if (to_uint(part.substr(0, dash), a) && to_uint(part.substr(dash + 1), b)) {
+			for (unsigned int v = a; v <= b; v++) ret.push_back(v);
+		}
+		i = end + 1;
+	}
+	return ret;
+}
+
+// ================================================================================================
+
+static machine load() {
+	machine sys;
+	std::string line;
+	
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		for (unsigned int i = 0; i < std::thread::hardware_concurrency() && i < CPU_SETSIZE; i++) CPU_SET(i, &allowed);
+	}
+	
+	std::vector<unsigned int> online;
+	if (read_line(SYS_CPU "online", line)) online = parse_list(line);
+	if (online.empty()) for (unsigned int i = 0; i < CPU_SETSIZE; i++) if (CPU_ISSET(i, &allowed)) online.push_back(i);
+	
+	for (unsigned int id : online) {
+		if (id >= CPU_SETSIZE || !CPU_ISSET(id, &allowed)) continue;
+		cpu c { id, id, 0, 0 };
+		std::string base = SYS_CPU "cpu" + std::to_string(id) + "/topology/";
+		if (read_line(base + "core_id", line)) to_uint(line, c.core);
+		if (read_line(base + "physical_package_id", line)) to_uint(line, c.package);
+		sys.cpus.push_back(c);
+	}
+	if (sys.cpus.empty()) sys.cpus.push_back({0, 0, 0, 0});
+	
+	std::vector<unsigned int> nodes_online;
+	if (read_line(SYS_NODE "online", line)) nodes_online = parse_list(line);
+	for (unsigned int n : nodes_online) {
+		if (!read_line(SYS_NODE "node" + std::to_string(n) + "/cpulist", line)) continue;
+		for (unsigned int id : parse_list(line)) {
+			for (cpu & c : sys.cpus) if (c.id == id) c.node = n;
+		}
+	}
+	
+	for (cpu const & c : sys.cpus) {
+		auto it = std::find_if(sys.nodes.begin(), sys.nodes.end(), [&c](node const & n){ return n.id == c.node; });
+		if (it == sys.nodes.end()) it = sys.nodes.insert(sys.nodes.end(), node { c.node, {} });
+		it->cpus.push_back(c.id);
+	}
+	std::sort(sys.nodes.begin(), sys.nodes.end(), [](node const & a, node const & b){ return a.id < b.id; });
+	return sys;
+}
+
+machine const & asterales::topology::get() {
+	static machine sys = load();
+	return sys;
+}
+
+cpu const * machine::find(unsigned int id) const {
+	for (cpu const & c : cpus) if (c.id == id) return &c;
+	return nullptr;
+}
+
+size_t machine::node_index(unsigned int node_id) const {
+	for (size_t i = 0; i < nodes.size(); i++) if (nodes[i].id == node_id) return i;
+	return npos;
+}
+
+static bool pin_handle(pthread_t th, std::vector<unsigned int> const & cpus) {
+	if (cpus.empty()) return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned int id : cpus) if (id < CPU_SETSIZE) CPU_SET(id, &set);
+	return pthread_setaffinity_np(th, sizeof(set), &set) == 0;
+}
+
+bool asterales::topology::pin(std::thread & th, std::vector<unsigned int> const & cpus) {
+	return pin_handle(th.native_handle(), cpus);
+}
+
+bool asterales::topology::pin_self(std::vector<unsigned int> const & cpus) {
+	return pin_handle(pthread_self(), cpus);
+}
+
+// ================================================================================================
+
+struct node_cpus {
+	size_t node_index;
+	std::vector<cpu const *> cpus; // first SMT sibling of every core before any second one
+};
+
+static std::vector<node_cpus> candidates(placement const & pl) {
+	machine const & sys = get();
+	std::vector<node_cpus> ret;
+	for (size_t ni = 0; ni < sys.nodes.size(); ni++) {
+		node_cpus nc { ni, {} };
+		std::vector<std::pair<size_t, cpu const *>> ranked;
+		for (unsigned int id : sys.nodes[ni].cpus) {
+			if (!pl.cpus.empty() && std::find(pl.cpus.begin(), pl.cpus.end(), id) == pl.cpus.end()) continue;
+			cpu const * c = sys.find(id);
+			size_t sibling = 0;
+			for (auto const & r : ranked) if (r.second->package == c->package && r.second->core == c->core) sibling++;
+			ranked.emplace_back(sibling, c);
+		}
+		std::stable_sort(ranked.begin(), ranked.end(), [](auto const & a, auto const & b){ return a.first < b.first; });
+		for (auto const & r : ranked) nc.cpus.push_back(r.second);
+		if (!nc.cpus.empty()) ret.push_back(std::move(nc));
+	}
+	return ret;
+}
+
+static placement::slot assign_from(std::vector<node_cpus> const & nodes, placement::policy p, size_t index) {
+	placement::slot ret;
+	if (nodes.empty()) return ret;
+	
+	switch (p) {
+		case placement::policy::none: break;
+		case placement::policy::compact: {
+			size_t total = 0;
+			for (auto const & n : nodes) total += n.cpus.size();
+			index %= total;
+			for (auto const & n : nodes) {
+				if (index < n.cpus.size()) {
+					ret.cpus.push_back(n.cpus[index]->id);
+					ret.node = n.node_index;
+					break;
+				}
+				index -= n.cpus.size();
+			}
+			break;
+		}
+		case placement::policy::scatter: {
+			auto const & n = nodes[index % nodes.size()];
+			ret.cpus.push_back(n.cpus[(index / nodes.size()) % n.cpus.size()]->id);
+			ret.node = n.node_index;
+			break;
+		}
+		case placement::policy::node: {
+			auto const & n = nodes[index % nodes.size()];
+			for (cpu const * c : n.cpus) ret.cpus.push_back(c->id);
+			ret.node = n.node_index;
+			break;
+		}
+	}
+	return ret;
+}
+
+std::vector<unsigned int> placement::assign(size_t index) const {
+	if (p == policy::none) return {};
+	return assign_from(candidates(*this), p, index).cpus;
+}
+
+size_t placement::node_of(size_t index) const {
+	if (p == policy::none) return npos;
+	return assign_from(candidates(*this), p, index).node;
+}
+
+std::vector<placement::slot> placement::plan(size_t threads) const {
+	std::vector<slot> ret (threads);
+	if (p == policy::none) return ret;
+	std::vector<node_cpus> nodes = candidates(*this);
+	for (size_t i = 0; i < threads; i++) ret[i] = assign_from(nodes, p, i);
+	return ret;
+}
+
+size_t placement::nodes_used() const {
+	if (p == policy::none) return 1;
+	size_t n = candidates(*this).size();
+	return n ? n : 1;
+}
@@ -165,6 +165,25 @@ void tests::buffer_assembly_tests() {
 		auto tm = tk.mark();
 		tlog << tm.sec() << " sec";
 	}
+	tlogi << "PREPARE + COMMIT: ";
+	{
+		tk.mark();
+		TESTLOOP {
+			buf.clear();
+			buf.write(teststr, teststrlen);
+			buf.discard(5);
+			size_t size = rng;
+			auto * p = buf.prepare(size);
+			TEST(buf.spare() >= size);
+			TEST(buf.size() == teststrlen - 5);
+			memset(p, 'A', size);
+			buf.commit(size);
+			TEST(buf.size() == teststrlen - 5 + size);
+			TEST(!strncmp(teststr + 5, (char const *)buf.data(), teststrlen - 5));
+		}
+		auto tm = tk.mark();
+		tlog << tm.sec() << " sec";
+	}
 	tlog << "SERIALIZATION: ";
 	{
 		std::uniform_int_distribution<uint8_t> dist8 (0, std::numeric_limits<uint8_t>::max());
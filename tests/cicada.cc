@@ -0,0 +1,1038 @@
+#include "tests.hh"
+
+#include "asterales/cicada.hh"
+
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace cicada = asterales::cicada;
+
+static constexpr size_t bulk_size = 1 << 20;
+
+static cicada::connection make_pair(int & other) {
+	int fds [2];
+	int e = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	TEST(e == 0);
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	other = fds[1];
+	cicada::socket sock;
+	sock.FD = fds[0];
+	return cicada::connection { std::move(sock) };
+}
+
+static void bulk_read(bool query) {
+	int other;
+	cicada::connection con = make_pair(other);
+	con.read_query = query;
+	std::thread writer { [other](){
+		std::vector<uint8_t> data (bulk_size);
+		for (size_t i = 0; i < bulk_size; i++) data[i] = i % 251;
+		size_t sent = 0;
+		while (sent < bulk_size) {
+			ssize_t e = ::write(other, data.data() + sent, bulk_size - sent);
+			if (e <= 0) break;
+			sent += e;
+		}
+		::close(other);
+	} };
+	asterales::buffer_assembly buf;
+	while (true) {
+		ssize_t e = con.read(buf);
+		if (e < 0) break;
+	}
+	writer.join();
+	TEST(buf.size() == bulk_size);
+	for (size_t i = 0; i < bulk_size; i++) TEST(buf[i] == i % 251);
+	tlog << "  " << (query ? "FIONREAD" : "ADAPTIVE") << ": final hint " << con.read_hint;
+}
+
+static std::atomic_size_t backpressure_engaged {0};
+
+struct echo_protocol : public cicada::reactor::protocol {
+	asterales::buffer_assembly buf;
+	virtual void backpressure(bool engaged) override { if (engaged) backpressure_engaged++; }
+	virtual cicada::reactor::signal ready(cicada::connection & con, cicada::reactor::detail const &) override {
+		cicada::reactor::signal sig;
+		ssize_t e = con.read(buf);
+		con.queue(std::move(buf));
+		buf = asterales::buffer_assembly {};
+		sig.m = e < 0 ? cicada::reactor::signal::mask::terminate : cicada::reactor::signal::mask::wait_for_read;
+		return sig;
+	}
+	virtual cicada::reactor::signal::mask::type default_mask() override { return cicada::reactor::signal::mask::wait_for_read; }
+};
+
+// reads and drops everything, queues nothing of its own
+struct sink_protocol : public cicada::reactor::protocol {
+	std::atomic_size_t & consumed;
+	std::atomic_bool & paused;
+	sink_protocol(std::atomic_size_t & consumed, std::atomic_bool & paused) : consumed(consumed), paused(paused) {}
+	virtual void backpressure(bool engaged) override { paused = engaged; }
+	virtual cicada::reactor::signal ready(cicada::connection & con, cicada::reactor::detail const &) override {
+		cicada::reactor::signal sig;
+		asterales::buffer_assembly buf;
+		ssize_t e = con.read(buf);
+		consumed += buf.size();
+		sig.m = e < 0 ? cicada::reactor::signal::mask::terminate : cicada::reactor::signal::mask::wait_for_read;
+		return sig;
+	}
+	virtual cicada::reactor::signal::mask::type default_mask() override { return cicada::reactor::signal::mask::wait_for_read; }
+};
+
+static bool echo_roundtrip(cicada::reactor & r, std::string const & msg) {
+	int other;
+	cicada::connection con = make_pair(other);
+	r.accept_connection(std::move(con), std::make_unique<echo_protocol>());
+	if (::write(other, msg.data(), msg.size()) != static_cast<ssize_t>(msg.size())) return false;
+	std::string got;
+	while (got.size() < msg.size()) {
+		pollfd pfd { other, POLLIN, 0 };
+		if (poll(&pfd, 1, 5000) != 1) break;
+		char rbuf [256];
+		ssize_t e = ::read(other, rbuf, sizeof(rbuf));
+		if (e <= 0) break;
+		got.append(rbuf, e);
+	}
+	::close(other);
+	return got == msg;
+}
+
+static uint16_t free_port() {
+	int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t alen = sizeof(addr);
+	bind(fd, reinterpret_cast<sockaddr *>(&addr), alen);
+	getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &alen);
+	::close(fd);
+	return ntohs(addr.sin_port);
+}
+
+static std::atomic_size_t hello_echoes {0}, hello_failures {0};
+
+struct hello_protocol : public cicada::reactor::protocol {
+	asterales::buffer_assembly buf;
+	bool sent = false;
+	virtual cicada::reactor::signal ready(cicada::connection & con, cicada::reactor::detail const &) override {
+		cicada::reactor::signal sig;
+		if (!sent) {
+			asterales::buffer_assembly hello;
+			hello << "hello";
+			con.queue(std::move(hello));
+			sent = true;
+		}
+		ssize_t e = con.read(buf);
+		if (buf.size() >= 5) hello_echoes++;
+		sig.m = e < 0 || buf.size() >= 5 ? cicada::reactor::signal::mask::terminate : cicada::reactor::signal::mask::wait_for_read;
+		return sig;
+	}
+};
+
+struct hello_instantiator : public cicada::reactor::protocol_instantiator {
+	virtual std::unique_ptr<cicada::reactor::protocol> instantiate() override { return std::make_unique<hello_protocol>(); }
+	virtual void connect_failed() override { hello_failures++; }
+};
+
+static std::atomic_size_t pooled_done {0};
+
+struct pooled_ping : public cicada::reactor::protocol {
+	asterales::buffer_assembly buf;
+	bool sent = false;
+	virtual cicada::reactor::signal ready(cicada::connection & con, cicada::reactor::detail const &) override {
+		cicada::reactor::signal sig;
+		if (!sent) {
+			asterales::buffer_assembly ping;
+			ping << "ping";
+			con.queue(std::move(ping));
+			sent = true;
+		}
+		ssize_t e = con.read(buf);
+		if (e < 0) sig.m = cicada::reactor::signal::mask::terminate;
+		else if (buf.size() < 4) sig.m = cicada::reactor::signal::mask::wait_for_read;
+		else {
+			pooled_done++;
+			sig.m = cicada::reactor::signal::mask::switch_protocols;
+			sig.protocol_switch = cicada::connection_pool::checkin();
+		}
+		return sig;
+	}
+};
+
+static std::atomic_size_t ping_failures {0};
+
+struct ping_instantiator : public cicada::reactor::protocol_instantiator {
+	virtual std::unique_ptr<cicada::reactor::protocol> instantiate() override { return std::make_unique<pooled_ping>(); }
+	virtual void connect_failed() override { ping_failures++; }
+};
+
+struct framed_echo : public cicada::framed_protocol {
+	virtual void frame(cicada::connection &, asterales::aeon::object && obj) override {
+		if (obj.is_string() && obj.string() == "bye") return close();
+		asterales::aeon::object reply = asterales::aeon::map();
+		reply["echo"] = std::move(obj);
+		send(reply);
+	}
+};
+
+static std::atomic_size_t framed_paused {0};
+
+struct framed_echo_paused : public framed_echo {
+	virtual void backpressure(bool engaged) override {
+		framed_echo::backpressure(engaged);
+		if (engaged) framed_paused++;
+	}
+};
+
+static asterales::buffer_assembly encode_frame(asterales::aeon::object const & obj) {
+	asterales::buffer_assembly payload = obj.serialize_binary(), ret;
+	uint64_t len = payload.size();
+	do {
+		uint8_t b = len & 0x7F;
+		len >>= 7;
+		ret.write(static_cast<uint8_t>(b | (len ? 0x80 : 0)));
+	} while (len);
+	ret << payload;
+	return ret;
+}
+
+// reads frames until <count> arrived or the peer closed
+static std::vector<asterales::aeon::object> read_frames(int fd, size_t count) {
+	std::vector<asterales::aeon::object> ret;
+	asterales::buffer_assembly buf;
+	while (ret.size() < count) {
+		pollfd pfd { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 5000) != 1) break;
+		char rbuf [65536];
+		ssize_t e = ::read(fd, rbuf, sizeof(rbuf));
+		if (e <= 0) break;
+		buf.write(reinterpret_cast<asterales::buffer_assembly::byte_t const *>(rbuf), e);
+		while (buf.size()) {
+			uint64_t len = 0;
+			size_t prefix = 0;
+			while (prefix < buf.size()) {
+				len |= static_cast<uint64_t>(buf[prefix] & 0x7F) << (7 * prefix);
+				if (!(buf[prefix++] & 0x80)) break;
+			}
+			if (buf[prefix - 1] & 0x80 || buf.size() < prefix + len) break;
+			buf.discard(prefix);
+			ret.push_back(asterales::aeon::parse_binary(buf));
+		}
+	}
+	return ret;
+}
+
+static std::atomic_size_t fiber_unwound {0};
+
+struct unwind_marker {
+	~unwind_marker() { fiber_unwound++; }
+};
+
+// each request is a length and a repeat count followed by <length> bytes, answered with those bytes repeated
+struct fiber_echo : public cicada::fiber_protocol {
+	virtual void run(cicada::fiber_io & io) override {
+		unwind_marker marker;
+		asterales::buffer_assembly in;
+		while (io.read(in, 8)) {
+			uint32_t len, repeat;
+			memcpy(&len, in.data(), 4);
+			memcpy(&repeat, in.data() + 4, 4);
+			if (!io.read(in, 8 + len)) return;
+			in.discard(8);
+			asterales::buffer_assembly out;
+			for (uint32_t i = 0; i < repeat; i++) out.write(in.data(), len);
+			in.discard(len);
+			if (!io.write(std::move(out))) return;
+		}
+	}
+};
+
+// echoes everything prefixed with the tag of the process that answered
+struct tagged_echo : public cicada::reactor::protocol {
+	tagged_echo(char tag_) : tag {tag_} {}
+	char tag;
+	virtual cicada::reactor::signal ready(cicada::connection & con, cicada::reactor::detail const &) override {
+		cicada::reactor::signal sig;
+		asterales::buffer_assembly in, out;
+		ssize_t e = con.read(in);
+		if (in.size()) {
+			out.write(static_cast<uint8_t>(tag));
+			out << in;
+			con.queue(std::move(out));
+		}
+		sig.m = e < 0 ? cicada::reactor::signal::mask::terminate : cicada::reactor::signal::mask::wait_for_read;
+		return sig;
+	}
+	virtual cicada::reactor::signal::mask::type default_mask() override { return cicada::reactor::signal::mask::wait_for_read; }
+};
+
+struct tagged_instantiator : public cicada::reactor::protocol_instantiator {
+	tagged_instantiator(char tag_) : tag {tag_} {}
+	char tag;
+	virtual std::unique_ptr<cicada::reactor::protocol> instantiate() override { return std::make_unique<tagged_echo>(tag); }
+};
+
+static int tcp_connect(uint16_t port) {
+	int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// the tag of whoever answered <msg> on <fd>, 0 on failure
+static char tagged_roundtrip(int fd, std::string const & msg) {
+	if (fd == -1 || ::write(fd, msg.data(), msg.size()) != static_cast<ssize_t>(msg.size())) return 0;
+	std::string got;
+	while (got.size() < msg.size() + 1) {
+		pollfd pfd { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 5000) != 1) break;
+		char rbuf [256];
+		ssize_t e = ::read(fd, rbuf, sizeof(rbuf));
+		if (e <= 0) break;
+		got.append(rbuf, e);
+	}
+	return got.size() == msg.size() + 1 && got.compare(1, msg.size(), msg) == 0 ? got[0] : 0;
+}
+
+static bool wait_until(std::function<bool()> pred) {
+	for (size_t i = 0; i < 500 && !pred(); i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	return pred();
+}
+
+static void reactor_tests(cicada::reactor::trigger_mode mode) {
+	char const * mode_name = mode == cicada::reactor::trigger_mode::edge ? "EDGE" : "ONESHOT";
+	
+	tlog << "REACTOR ECHO + CHURN (" << mode_name << "):";
+	{
+		cicada::reactor r {true, 4};
+		r.set_trigger_mode(mode);
+		asterales::topology::placement pl;
+		pl.p = mode == cicada::reactor::trigger_mode::edge ? asterales::topology::placement::policy::node : asterales::topology::placement::policy::scatter;
+		r.set_placement(pl);
+		r.set_lock_stats(true);
+		for (size_t i = 0; i < 500; i++) TEST(echo_roundtrip(r, "ping " + std::to_string(i)));
+		std::vector<std::thread> clients;
+		std::atomic_size_t failures {0};
+		for (size_t t = 0; t < 8; t++) clients.emplace_back([&r, &failures, t](){
+			for (size_t i = 0; i < 200; i++) if (!echo_roundtrip(r, "client " + std::to_string(t) + " " + std::to_string(i))) failures++;
+		});
+		// placement may change while connections are accepted and dispatched
+		std::thread placer {[&r, &pl](){
+			asterales::topology::placement none;
+			for (size_t i = 0; i < 20; i++) {
+				r.set_placement(i % 2 ? pl : none);
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+			r.set_placement(pl);
+		}};
+		for (auto & c : clients) c.join();
+		placer.join();
+		TEST(failures == 0);
+		
+		auto stats = r.stats();
+		TEST(stats["connections"]["accepted"].as_integer() == 2100);
+		TEST(stats["events"]["read_available"].as_integer() > 0);
+		TEST(stats["io"]["bytes_in"].as_integer() > 0);
+		TEST(stats["ready_duration"]["count"].as_integer() > 0);
+		TEST(stats["locks"]["queue"]["acquisitions"].as_integer() > 0);
+		TEST(stats["locks"]["connections"]["acquisitions"].as_integer() > 0);
+		TEST(stats["locks"]["queue"]["contended"].as_integer() <= stats["locks"]["queue"]["acquisitions"].as_integer());
+	}
+	
+	tlog << "REACTOR BACKPRESSURE (" << mode_name << "):";
+	{
+		backpressure_engaged = 0;
+		cicada::reactor r {true, 2};
+		r.set_trigger_mode(mode);
+		cicada::reactor::watermarks wm;
+		wm.low = 1 << 14;
+		wm.high = 1 << 16;
+		r.set_watermarks(wm);
+		
+		int other;
+		cicada::connection con = make_pair(other);
+		r.accept_connection(std::move(con), std::make_unique<echo_protocol>());
+		std::thread writer { [other](){
+			std::vector<uint8_t> data (bulk_size);
+			for (size_t i = 0; i < bulk_size; i++) data[i] = i % 251;
+			size_t sent = 0;
+			while (sent < bulk_size) {
+				ssize_t e = ::write(other, data.data() + sent, bulk_size - sent);
+				if (e <= 0) break;
+				sent += e;
+			}
+		} };
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		TEST(backpressure_engaged > 0);
+		TEST(r.queued_total() < (1 << 16) + (1 << 19));
+		asterales::buffer_assembly received;
+		while (received.size() < bulk_size) {
+			pollfd pfd { other, POLLIN, 0 };
+			if (poll(&pfd, 1, 5000) != 1) break;
+			char rbuf [65536];
+			ssize_t e = ::read(other, rbuf, sizeof(rbuf));
+			if (e <= 0) break;
+			received.write(reinterpret_cast<asterales::buffer_assembly::byte_t const *>(rbuf), e);
+		}
+		writer.join();
+		::close(other);
+		TEST(received.size() == bulk_size);
+		for (size_t i = 0; i < bulk_size; i++) TEST(received[i] == i % 251);
+	}
+	
+	tlog << "REACTOR BUDGET (" << mode_name << "):";
+	{
+		cicada::reactor r {true, 2};
+		r.set_trigger_mode(mode);
+		cicada::reactor::watermarks wm;
+		wm.low = 1 << 14;
+		wm.high = 1 << 19;
+		wm.budget_low = 1 << 14;
+		wm.budget_high = 1 << 16;
+		r.set_watermarks(wm);
+		
+		// a peer that never reads pushes the total over the budget
+		int hog_other;
+		r.accept_connection(make_pair(hog_other), std::make_unique<echo_protocol>());
+		fcntl(hog_other, F_SETFL, fcntl(hog_other, F_GETFL) | O_NONBLOCK);
+		std::vector<uint8_t> data (1 << 16, 7);
+		size_t fed = 0;
+		bool over = wait_until([&](){ // keep feeding until the socket buffers are full and the rest sits in the output queue
+			ssize_t e = ::write(hog_other, data.data(), data.size());
+			if (e > 0) fed += e;
+			return r.queued_total() > (1 << 16);
+		});
+		TEST(over);
+		
+		// a connection that queues nothing itself is still held back, its first turn reads and then reading pauses
+		std::atomic_size_t consumed {0};
+		std::atomic_bool paused {false};
+		int sink_other;
+		r.accept_connection(make_pair(sink_other), std::make_unique<sink_protocol>(consumed, paused));
+		ssize_t e = ::write(sink_other, data.data(), 1000);
+		TEST(e == 1000);
+		bool engaged = wait_until([&](){ return paused.load(); });
+		TEST(engaged);
+		TEST(consumed == 1000);
+		e = ::write(sink_other, data.data(), 1000);
+		TEST(e == 1000);
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		TEST(consumed == 1000);
+		
+		// draining the hog releases the budget and the sink catches up
+		size_t drained = 0;
+		while (drained < fed) {
+			pollfd pfd { hog_other, POLLIN, 0 };
+			if (poll(&pfd, 1, 5000) != 1) break;
+			char rbuf [65536];
+			e = ::read(hog_other, rbuf, sizeof(rbuf));
+			if (e < 0 && errno == EAGAIN) continue;
+			if (e <= 0) break;
+			drained += e;
+		}
+		TEST(drained == fed);
+		bool resumed = wait_until([&](){ return consumed == 2000 && !paused; });
+		TEST(resumed);
+		::close(hog_other);
+		::close(sink_other);
+	}
+}
+
+void tests::cicada_tests() {
+	tlog << "STARTING CICADA TESTS\n";
+	
+	tlog << "BUFFER READ:";
+	bulk_read(false);
+	bulk_read(true);
+	
+	tlog << "BOUNDED READ:";
+	{
+		int other;
+		cicada::connection con = make_pair(other);
+		ssize_t e = ::write(other, "0123456789", 10);
+		TEST(e == 10);
+		asterales::buffer_assembly buf;
+		e = con.read(buf, 4);
+		TEST(e == 4);
+		TEST(buf.to_string() == "0123");
+		e = con.read(buf);
+		TEST(e == 6);
+		TEST(buf.to_string() == "0123456789");
+		e = con.read(buf);
+		TEST(e == 0);
+		::close(other);
+		e = con.read(buf);
+		TEST(e == -1);
+	}
+	
+	tlog << "GATHER WRITE:";
+	{
+		int other;
+		cicada::connection con = make_pair(other);
+		asterales::buffer_assembly head, body, tail;
+		head << "HEAD ";
+		body << "BODY ";
+		tail << "TAIL";
+		ssize_t e = con.write({&head, &body, &tail});
+		TEST(e == 14);
+		TEST(head.size() == 5);
+		e = con.write_consume({&head, &body, &tail});
+		TEST(e == 14);
+		TEST(!head.size() && !body.size() && !tail.size());
+		char rbuf [64] {};
+		e = ::read(other, rbuf, sizeof(rbuf));
+		TEST(e == 28);
+		TEST(std::string {rbuf} == "HEAD BODY TAILHEAD BODY TAIL");
+		::close(other);
+	}
+	
+	tlog << "OUTPUT QUEUE:";
+	{
+		int other;
+		cicada::connection con = make_pair(other);
+		for (size_t i = 0; i < 200; i++) {
+			asterales::buffer_assembly buf;
+			buf.resize(4096);
+			memset(buf.data(), i, 4096);
+			con.queue(std::move(buf));
+		}
+		TEST(con.queued() == 200 * 4096);
+		asterales::buffer_assembly received;
+		std::thread reader { [other, &received](){
+			while (true) {
+				char rbuf [8192];
+				ssize_t e = ::read(other, rbuf, sizeof(rbuf));
+				if (e <= 0) break;
+				received.write(reinterpret_cast<asterales::buffer_assembly::byte_t const *>(rbuf), e);
+			}
+		} };
+		while (con.queued()) {
+			ssize_t e = con.flush();
+			TEST(e >= 0);
+			if (e < 0) break;
+		}
+		con.close();
+		reader.join();
+		TEST(received.size() == 200 * 4096);
+		for (size_t i = 0; i < 200; i++) TEST(received[i * 4096] == static_cast<uint8_t>(i) && received[i * 4096 + 4095] == static_cast<uint8_t>(i));
+		::close(other);
+	}
+	
+	tlog << "ZEROCOPY:";
+	{
+		auto payload = std::make_shared<asterales::buffer_assembly>();
+		for (size_t i = 0; i < 100000; i++) payload->write(static_cast<uint8_t>(i % 241));
+		
+		// a socket that can't opt in gets a copying write, nothing is held waiting for a completion that never comes
+		int other;
+		cicada::connection local = make_pair(other);
+		bool enabled = local.zerocopy();
+		TEST(!enabled);
+		ssize_t e = local.write_zerocopy(payload, 99990);
+		TEST(e == 10);
+		TEST(!local.zerocopy_pending());
+		TEST(payload.use_count() == 1);
+		::close(other);
+		
+		// over tcp every send is held until its completion is reaped from the error queue
+		int lfd = ::socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t alen = sizeof(addr);
+		int bound = ::bind(lfd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+		TEST(bound == 0);
+		::listen(lfd, 1);
+		getsockname(lfd, reinterpret_cast<sockaddr *>(&addr), &alen);
+		int cfd = tcp_connect(ntohs(addr.sin_port));
+		TEST(cfd != -1);
+		other = ::accept(lfd, nullptr, nullptr);
+		::close(lfd);
+		cicada::socket sock;
+		sock.FD = cfd;
+		cicada::connection con { std::move(sock) };
+		enabled = con.zerocopy();
+		TEST(enabled);
+		
+		asterales::buffer_assembly received;
+		std::thread reader { [other, &received](){
+			while (true) {
+				char rbuf [8192];
+				ssize_t e = ::read(other, rbuf, sizeof(rbuf));
+				if (e <= 0) break;
+				received.write(reinterpret_cast<asterales::buffer_assembly::byte_t const *>(rbuf), e);
+			}
+		} };
+		size_t sends = 0;
+		for (size_t offs = 0; offs < payload->size(); sends++) {
+			e = con.write_zerocopy(payload, offs);
+			TEST(e >= 0);
+			if (e < 0) break;
+			offs += e;
+		}
+		TEST(payload.use_count() > 1 || !con.zerocopy_pending());
+		size_t completed = 0;
+		for (size_t i = 0; i < 500 && con.zerocopy_pending(); i++) {
+			pollfd pfd { con.FD, 0, 0 }; // completions raise POLLERR whatever is asked for
+			poll(&pfd, 1, 10);
+			completed += con.reap_zerocopy();
+		}
+		TEST(!con.zerocopy_pending());
+		TEST(payload.use_count() == 1);
+		TEST(completed > 0 && completed <= sends);
+		TEST(con.zerocopy_copied() <= completed);
+		con.close();
+		reader.join();
+		::close(other);
+		TEST(received.size() == payload->size());
+		TEST(!memcmp(received.data(), payload->data(), payload->size()));
+	}
+	
+	tlog << "SPLICE:";
+	{
+		char path [] = "/tmp/cicada_splice_XXXXXX";
+		int fd = mkstemp(path);
+		TEST(fd >= 0);
+		unlink(path);
+		std::vector<uint8_t> data (300000);
+		for (size_t i = 0; i < data.size(); i++) data[i] = i % 253;
+		ssize_t written = ::write(fd, data.data(), data.size());
+		TEST(written == static_cast<ssize_t>(data.size()));
+		
+		int other;
+		cicada::connection con = make_pair(other);
+		asterales::buffer_assembly received;
+		std::thread reader { [other, &received](){
+			while (true) {
+				char rbuf [8192];
+				ssize_t e = ::read(other, rbuf, sizeof(rbuf));
+				if (e <= 0) break;
+				received.write(reinterpret_cast<asterales::buffer_assembly::byte_t const *>(rbuf), e);
+			}
+		} };
+		off_t offs = 0;
+		size_t left = data.size();
+		while (left) {
+			ssize_t e = con.splice(fd, &offs, left);
+			TEST(e >= 0);
+			if (e < 0) break;
+			left -= e;
+		}
+		TEST(!con.splice_buffered());
+		con.close();
+		reader.join();
+		::close(fd);
+		::close(other);
+		TEST(received.size() == data.size());
+		TEST(!memcmp(received.data(), data.data(), data.size()));
+	}
+	
+	tlog << "SENDFILE CACHE:";
+	{
+		char path [] = "/tmp/cicada_sendfile_XXXXXX";
+		int fd = mkstemp(path);
+		TEST(fd >= 0);
+		ssize_t written = ::write(fd, "0123456789", 10);
+		TEST(written == 10);
+		cicada::sendfile_helper::cache_configure(4, asterales::time::span {0});
+		cicada::sendfile_helper::cache_clear();
+		
+		auto send_all = [&](off_t offset, size_t count) {
+			int other;
+			cicada::connection con = make_pair(other);
+			cicada::sendfile_helper sh {path, offset, count};
+			while (!sh.is_done()) {
+				ssize_t e = con.sendfile(sh);
+				TEST(e >= 0);
+				if (e < 0) break;
+			}
+			con.close();
+			char rbuf [64] {};
+			ssize_t e = ::read(other, rbuf, sizeof(rbuf) - 1);
+			::close(other);
+			return std::string {rbuf, e > 0 ? static_cast<size_t>(e) : 0};
+		};
+		
+		std::string got = send_all(0, SIZE_MAX);
+		TEST(got == "0123456789");
+		got = send_all(4, 3);
+		TEST(got == "456");
+		TEST(cicada::sendfile_helper::cache_size() == 1);
+		
+		written = ::write(fd, "ABCDEF", 6);
+		TEST(written == 6);
+		got = send_all(8, SIZE_MAX);
+		TEST(got == "89ABCDEF");
+		TEST(cicada::sendfile_helper::cache_size() == 1);
+		
+		cicada::sendfile_helper::cache_configure(0, asterales::time::span {1});
+		TEST(cicada::sendfile_helper::cache_size() == 0);
+		got = send_all(0, 2);
+		TEST(got == "01");
+		TEST(cicada::sendfile_helper::cache_size() == 0);
+		cicada::sendfile_helper::cache_configure(256, asterales::time::span {1});
+		
+		// a file cut short after its size was taken ends the send with an error instead of waiting forever for bytes that won't come
+		{
+			int other;
+			cicada::connection con = make_pair(other);
+			cicada::sendfile_helper sh {path, 0, SIZE_MAX};
+			int cut = ftruncate(fd, 4);
+			TEST(cut == 0);
+			ssize_t e = 0;
+			for (size_t i = 0; i < 100 && e >= 0 && !sh.is_done(); i++) e = con.sendfile(sh);
+			TEST(e < 0);
+			TEST(!sh.is_done());
+			::close(other);
+		}
+		
+		::close(fd);
+		unlink(path);
+	}
+	
+	reactor_tests(cicada::reactor::trigger_mode::oneshot);
+	reactor_tests(cicada::reactor::trigger_mode::edge);
+	
+	tlog << "REACTOR CONNECT:";
+	{
+		uint16_t port = free_port();
+		cicada::reactor server {true, 2};
+		server.listen<echo_protocol>(port);
+		cicada::reactor client {true, 2};
+		auto pi = std::make_shared<hello_instantiator>();
+		
+		for (char const * host : {"127.0.0.1", "localhost", "localhost"}) client.connect(host, std::to_string(port), pi);
+		bool ok = wait_until([](){ return hello_echoes == 3; });
+		TEST(ok);
+		client.connect("localhost", std::to_string(port), pi);
+		ok = wait_until([](){ return hello_echoes == 4; });
+		TEST(ok);
+		TEST(hello_failures == 0);
+		
+		// nothing listens on a fresh port, every address is refused and the failure is reported once
+		client.connect("localhost", std::to_string(free_port()), pi);
+		ok = wait_until([](){ return hello_failures == 1; });
+		TEST(ok);
+		TEST(hello_echoes == 4);
+		
+		auto stats = client.stats();
+		TEST(stats["outbound"]["resolve_cache_hits"].as_integer() == 1);
+		TEST(stats["outbound"]["resolve_lookups"].as_integer() == 3);
+		TEST(stats["outbound"]["connect_failed"].as_integer() == 1);
+		
+		std::atomic_size_t fired {0};
+		client.schedule(std::chrono::milliseconds(50), [&fired](){ fired++; });
+		client.schedule(std::chrono::milliseconds(0), [&fired](){ fired++; });
+		ok = wait_until([&fired](){ return fired == 2; });
+		TEST(ok);
+		
+		// a listener that never accepts drops new handshakes once its queue is full, the attempt stalls until the connect timeout fails it
+		int lfd = ::socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t alen = sizeof(addr);
+		bind(lfd, reinterpret_cast<sockaddr *>(&addr), alen);
+		listen(lfd, 0);
+		getsockname(lfd, reinterpret_cast<sockaddr *>(&addr), &alen);
+		std::vector<int> fillers;
+		for (size_t i = 0; i < 4; i++) {
+			fillers.push_back(::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0));
+			::connect(fillers.back(), reinterpret_cast<sockaddr *>(&addr), alen);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		cicada::reactor::resolver_config cfg;
+		cfg.connect_timeout = std::chrono::milliseconds(200);
+		client.set_resolver_config(cfg);
+		auto begin = std::chrono::steady_clock::now();
+		client.connect("127.0.0.1", std::to_string(ntohs(addr.sin_port)), pi);
+		ok = wait_until([](){ return hello_failures == 2; });
+		TEST(ok);
+		TEST(std::chrono::steady_clock::now() - begin >= std::chrono::milliseconds(200));
+		TEST(hello_echoes == 4);
+		for (int fd : fillers) ::close(fd);
+		::close(lfd);
+	}
+	
+	tlog << "CONNECTION POOL:";
+	{
+		uint16_t port = free_port();
+		std::string service = std::to_string(port);
+		cicada::reactor server {true, 2};
+		server.listen<echo_protocol>(port);
+		cicada::reactor client {true, 2};
+		client.set_pulse_interval(std::chrono::milliseconds(100));
+		auto pi = std::make_shared<ping_instantiator>();
+		std::string key = "127.0.0.1:" + service;
+		
+		cicada::connection_pool::config cfg;
+		cfg.max_idle = 2;
+		cfg.max_per_host = 2;
+		cfg.idle_timeout = std::chrono::milliseconds(1000);
+		cicada::connection_pool pool {client, cfg};
+		
+		pool.acquire("127.0.0.1", service, pi);
+		bool ok = wait_until([&](){ return pooled_done == 1 && pool.stats()["hosts"][key]["idle"].as_integer() == 1; });
+		TEST(ok);
+		pool.acquire("127.0.0.1", service, pi);
+		ok = wait_until([&](){ return pooled_done == 2 && pool.stats()["hosts"][key]["idle"].as_integer() == 1; });
+		TEST(ok);
+		TEST(pool.stats()["connected"].as_integer() == 1);
+		TEST(pool.stats()["reused"].as_integer() == 1);
+		
+		// more acquires than max_per_host queue up and are served by connections as they come back
+		for (size_t i = 0; i < 20; i++) pool.acquire("127.0.0.1", service, pi);
+		ok = wait_until([&](){ return pooled_done == 22; });
+		TEST(ok);
+		auto stats = pool.stats();
+		TEST(stats["connected"].as_integer() <= 2);
+		TEST(stats["hosts"][key]["open"].as_integer() <= 2);
+		TEST(stats["hosts"][key]["waiting"].as_integer() == 0);
+		
+		// idle connections are closed by the pulse health check once past idle_timeout
+		ok = wait_until([&](){ return pool.stats()["hosts"][key]["open"].as_integer() == 0; });
+		TEST(ok);
+		TEST(pool.stats()["hosts"][key]["idle"].as_integer() == 0);
+		TEST(ping_failures == 0);
+	}
+	
+	tlog << "FRAMED PROTOCOL:";
+	{
+		namespace aeon = asterales::aeon;
+		cicada::reactor r {true, 2};
+		int other;
+		r.accept_connection(make_pair(other), std::make_unique<framed_echo>());
+		
+		std::vector<aeon::object> sent;
+		for (size_t i = 0; i < 50; i++) {
+			aeon::object obj = aeon::map();
+			obj["i"] = static_cast<aeon::int_t>(i);
+			asterales::buffer_assembly bin;
+			for (size_t j = 0; j < i * i * 8; j++) bin.write(static_cast<uint8_t>(j));
+			obj["bin"] = std::move(bin); // payloads from a few bytes to ~19K, one, two and three byte prefixes
+			sent.push_back(std::move(obj));
+		}
+		asterales::buffer_assembly wire;
+		for (auto const & obj : sent) wire << encode_frame(obj);
+		// the first frames trickle in a byte at a time so every prefix and payload is split across reads
+		size_t trickle = encode_frame(sent[0]).size() + encode_frame(sent[1]).size() + 3;
+		for (size_t i = 0; i < trickle; i++) {
+			ssize_t e = ::write(other, wire.data() + i, 1);
+			TEST(e == 1);
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+		ssize_t e = ::write(other, wire.data() + trickle, wire.size() - trickle);
+		TEST(e == static_cast<ssize_t>(wire.size() - trickle));
+		
+		auto replies = read_frames(other, sent.size());
+		TEST(replies.size() == sent.size());
+		for (size_t i = 0; i < replies.size() && i < sent.size(); i++) TEST(replies[i]["echo"] == sent[i]);
+		
+		asterales::buffer_assembly bye = encode_frame(aeon::object {"bye"});
+		e = ::write(other, bye.data(), bye.size());
+		TEST(e == static_cast<ssize_t>(bye.size()));
+		replies = read_frames(other, 1);
+		TEST(replies.empty()); // closed without a reply
+		::close(other);
+		
+		// a prefix that disagrees with the object it carries terminates the connection
+		r.accept_connection(make_pair(other), std::make_unique<framed_echo>());
+		asterales::buffer_assembly bad = encode_frame(aeon::object {"mismatch"});
+		bad[0]++;
+		bad.write(uint8_t {0});
+		e = ::write(other, bad.data(), bad.size());
+		TEST(e == static_cast<ssize_t>(bad.size()));
+		replies = read_frames(other, 1);
+		TEST(replies.empty());
+		::close(other);
+		
+		// lengths declared inside a small frame are checked before allocating, a 2 GiB string is refused and a huge array that runs into the frame after it terminates the connection
+		for (uint8_t type : {0x91, 0x93}) {
+			r.accept_connection(make_pair(other), std::make_unique<framed_echo>());
+			uint8_t hostile [] { 10, type, 0x83, 0xFF, 0xFF, 0xFF, 0x7F, 0x84, 0x84, 0x84, 0x84 };
+			asterales::buffer_assembly wire;
+			wire.write(hostile, sizeof(hostile));
+			wire << encode_frame(aeon::object {"after"});
+			e = ::write(other, wire.data(), wire.size());
+			TEST(e == static_cast<ssize_t>(wire.size()));
+			replies = read_frames(other, 1);
+			TEST(replies.empty());
+			::close(other);
+		}
+	}
+	
+	tlog << "FRAMED BACKPRESSURE:";
+	{
+		namespace aeon = asterales::aeon;
+		framed_paused = 0;
+		cicada::reactor r {true, 2};
+		cicada::reactor::watermarks wm;
+		wm.low = 1 << 14;
+		wm.high = 1 << 16;
+		r.set_watermarks(wm);
+		int other;
+		r.accept_connection(make_pair(other), std::make_unique<framed_echo_paused>());
+		
+		// a peer that writes far more than it reads, the replies stay bounded until it starts reading
+		static constexpr size_t frames = 1024;
+		std::thread writer { [other](){
+			asterales::buffer_assembly bin;
+			for (size_t j = 0; j < 1024; j++) bin.write(static_cast<uint8_t>(j));
+			for (size_t i = 0; i < frames; i++) {
+				aeon::object obj = aeon::map();
+				obj["i"] = static_cast<aeon::int_t>(i);
+				obj["bin"] = bin;
+				asterales::buffer_assembly wire = encode_frame(obj);
+				size_t sent = 0;
+				while (sent < wire.size()) {
+					ssize_t e = ::write(other, wire.data() + sent, wire.size() - sent);
+					if (e <= 0) return;
+					sent += e;
+				}
+			}
+		} };
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		TEST(framed_paused > 0);
+		TEST(r.queued_total() < (1 << 16) + (1 << 19));
+		auto replies = read_frames(other, frames);
+		writer.join();
+		::close(other);
+		TEST(replies.size() == frames);
+		for (size_t i = 0; i < replies.size(); i++) TEST(replies[i]["echo"]["i"].as_integer() == static_cast<aeon::int_t>(i));
+	}
+	
+	tlog << "FIBER PROTOCOL:";
+	for (auto mode : {cicada::reactor::trigger_mode::oneshot, cicada::reactor::trigger_mode::edge}) {
+		fiber_unwound = 0;
+		int other;
+		{
+			cicada::reactor r {true, 2};
+			r.set_trigger_mode(mode);
+			r.accept_connection(make_pair(other), std::make_unique<fiber_echo>());
+			
+			// small requests split mid header, then one answer far larger than the socket buffer so the fiber waits on write
+			for (uint32_t repeat : {1u, 3u, 1u << 16}) {
+				std::string payload = "fiber " + std::to_string(repeat);
+				uint32_t len = payload.size();
+				asterales::buffer_assembly req;
+				req.write(len);
+				req.write(repeat);
+				req << payload;
+				ssize_t e = ::write(other, req.data(), 5);
+				TEST(e == 5);
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+				e = ::write(other, req.data() + 5, req.size() - 5);
+				TEST(e == static_cast<ssize_t>(req.size() - 5));
+				
+				size_t expect = payload.size() * repeat;
+				std::string got;
+				while (got.size() < expect) {
+					pollfd pfd { other, POLLIN, 0 };
+					if (poll(&pfd, 1, 5000) != 1) break;
+					char rbuf [65536];
+					ssize_t e = ::read(other, rbuf, sizeof(rbuf));
+					if (e <= 0) break;
+					got.append(rbuf, e);
+				}
+				TEST(got.size() == expect);
+				bool match = true;
+				for (size_t i = 0; i < got.size(); i += payload.size()) if (got.compare(i, payload.size(), payload)) match = false;
+				TEST(match);
+			}
+			
+			// a peer hanging up ends the fiber through a failed read
+			::close(other);
+			bool unwound = wait_until([](){ return fiber_unwound == 1; });
+			TEST(unwound);
+			
+			// a fiber still suspended when the reactor goes away is unwound by its destructor
+			r.accept_connection(make_pair(other), std::make_unique<fiber_echo>());
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		TEST(fiber_unwound == 2);
+		::close(other);
+	}
+	
+	tlog << "DRAIN + HANDOFF:";
+	{
+		uint16_t port = free_port();
+		std::string path = "/tmp/asterales_handoff_" + std::to_string(getpid()) + ".sock";
+		int done [2];
+		int e = pipe(done);
+		TEST(e == 0);
+		
+		// forked before this section starts any threads, the child plays the replacement process
+		pid_t child = fork();
+		if (child == 0) {
+			::close(done[1]);
+			int status = 1;
+			{
+				cicada::reactor b {true, 2};
+				std::vector<int> fds = cicada::handoff::fetch(path, std::chrono::milliseconds(5000));
+				if (fds.size() == 1) {
+					b.adopt(fds[0], std::make_shared<tagged_instantiator>('B'));
+					status = 0;
+				}
+				char c;
+				while (::read(done[0], &c, 1) > 0);
+			}
+			_exit(status);
+		}
+		::close(done[0]);
+		
+		cicada::reactor a {true, 2};
+		a.listen(port, std::make_shared<tagged_instantiator>('A'));
+		int before = tcp_connect(port);
+		char tag = tagged_roundtrip(before, "before");
+		TEST(tag == 'A');
+		
+		bool served = cicada::handoff::serve(path, a.listener_descriptors(), std::chrono::milliseconds(5000));
+		TEST(served);
+		
+		// the open connection is still served by the draining process, new ones only by the replacement
+		std::thread drainer { [&a, before](){
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			char tag = tagged_roundtrip(before, "during");
+			TEST(tag == 'A');
+			::close(before);
+		} };
+		bool drained = a.drain(std::chrono::milliseconds(5000));
+		TEST(drained);
+		drainer.join();
+		for (size_t i = 0; i < 20; i++) {
+			int after = tcp_connect(port);
+			tag = tagged_roundtrip(after, "after");
+			TEST(tag == 'B');
+			::close(after);
+		}
+		
+		// connections outliving the deadline make drain report failure
+		int other;
+		a.accept_connection(make_pair(other), std::make_unique<echo_protocol>());
+		drained = a.drain(std::chrono::milliseconds(50));
+		TEST(!drained);
+		::close(other);
+		drained = a.drain(std::chrono::milliseconds(5000));
+		TEST(drained);
+		
+		::close(done[1]);
+		int status = -1;
+		pid_t reaped = waitpid(child, &status, 0);
+		TEST(reaped == child);
+		TEST(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	
+	tlog << "\nCICADA TESTS DONE";
+}
@@ -1,7 +1,11 @@
 #include "asterales/signal.hh"
 #include "tests.hh"
 
+#include <thread>
+#include <vector>
+
 using testsig1 = asterales::signal<int, float>;
+using testsig2 = asterales::signal<int>;
 
 void tests::signal_tests() {
 	testsig1 sig1;
@@ -11,4 +15,106 @@ void tests::signal_tests() {
 	});
 	sig1.fire(5, 3.5f);
 	//sig1.disconnect(1);
+	
+	tlog << "CONNECT AND DISCONNECT:";
+	{
+		testsig2 sig;
+		int a = 0, b = 0;
+		asterales::observer oa;
+		{
+			asterales::observer ob;
+			sig.connect(oa, [&a](int v){ a += v; });
+			sig.connect(ob, [&b](int v){ b += v; });
+			sig.fire(2);
+			TEST(a == 2 && b == 2);
+		}
+		sig.fire(3); // ob is gone, its callback with it
+		TEST(a == 5 && b == 2);
+		sig.disconnect(0);
+		sig.fire(4);
+		TEST(a == 5);
+	}
+	
+	tlog << "CHANGES FROM INSIDE A CALLBACK:";
+	{
+		testsig2 sig;
+		asterales::observer ob;
+		int once = 0, added = 0, nested = 0;
+		sig.connect(ob, [&](int){ // disconnects itself, the fire in progress still finishes its snapshot
+			once++;
+			sig.disconnect(0);
+		});
+		sig.connect(ob, [&](int v){
+			if (v == 0) {
+				sig.connect(ob, [&added](int){ added++; });
+				sig.fire(1);
+			} else nested++;
+		});
+		sig.fire(0);
+		TEST(once == 1);
+		TEST(nested == 1);
+		TEST(added == 1); // only the nested fire saw the new callback
+		sig.fire(1);
+		TEST(once == 1);
+		TEST(nested == 2);
+		TEST(added == 2);
+	}
+	
+	tlog << "CONCURRENT FIRES:";
+	{
+		testsig2 sig;
+		asterales::observer keep;
+		std::atomic_uint64_t kept {0};
+		sig.connect(keep, [&kept](int v){ kept += v; });
+		
+		std::atomic_bool stop {false};
+		std::vector<std::thread> firers;
+		for (size_t t = 0; t < 4; t++) firers.emplace_back([&](){
+			for (size_t i = 0; i < 20000; i++) sig.fire(1);
+		});
+		std::thread churn {[&](){ // connects and drops observers while the fires walk older snapshots
+			std::atomic_uint64_t sink {0};
+			for (size_t i = 0; i < 1000 && !stop; i++) { // ids are 16 bits, stay well short of wrapping onto the kept one
+				asterales::observer tmp;
+				sig.connect(tmp, [&sink](int v){ sink += v; });
+				std::this_thread::yield();
+			}
+		}};
+		for (auto & th : firers) th.join();
+		stop = true;
+		churn.join();
+		TEST(kept == 4 * 20000);
+	}
+	
+	tlog << "RECLAIM UNDER LOAD:";
+	{
+		// every fire waits for the next one to start before it returns, so some fire is always in progress
+		// replaced snapshots still have to go once the fires that could see them are done
+		testsig2 sig;
+		asterales::observer keep;
+		std::atomic_bool stop {false};
+		std::atomic_size_t entries {0};
+		sig.connect(keep, [&](int){
+			size_t me = ++entries;
+			while (entries.load() == me && !stop) std::this_thread::yield();
+		});
+		std::vector<std::thread> firers;
+		for (size_t t = 0; t < 4; t++) firers.emplace_back([&](){
+			while (!stop) sig.fire(0);
+		});
+		while (entries.load() < 16) std::this_thread::yield();
+		auto marker = std::make_shared<int>(0);
+		for (size_t i = 0; i < 200; i++) {
+			asterales::observer tmp;
+			sig.connect(tmp, [marker](int){});
+		}
+		bool released = false;
+		for (size_t i = 0; i < 500 && !released; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			released = marker.use_count() == 1;
+		}
+		stop = true;
+		for (auto & th : firers) th.join();
+		TEST(released);
+	}
 }
@@ -0,0 +1,157 @@
+#include "tests.hh"
+
+#include "asterales/synchro.hh"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// readers check that no writer is inside with them, writers check they are alone
+template <typename L> static void rw_exclusion(L & lock, size_t threads, size_t rounds) {
+	std::atomic_int inside_readers {0}, inside_writers {0};
+	std::atomic_bool broken {false};
+	uint64_t value = 0;
+	std::vector<std::thread> ths;
+	for (size_t t = 0; t < threads; t++) ths.emplace_back([&, t](){
+		for (size_t i = 0; i < rounds; i++) {
+			if ((i + t) % 8 == 0) {
+				lock.write_lock();
+				if (inside_writers.fetch_add(1) || inside_readers.load()) broken = true;
+				value++;
+				inside_writers.fetch_sub(1);
+				lock.write_unlock();
+			} else {
+				lock.read_access();
+				inside_readers.fetch_add(1);
+				if (inside_writers.load()) broken = true;
+				inside_readers.fetch_sub(1);
+				lock.read_done();
+			}
+		}
+	});
+	for (auto & th : ths) th.join();
+	TEST(!broken);
+	size_t writes = 0;
+	for (size_t t = 0; t < threads; t++) for (size_t i = 0; i < rounds; i++) if ((i + t) % 8 == 0) writes++;
+	TEST(value == writes);
+}
+
+template <typename L> static void mutex_exclusion(L & lock, size_t threads, size_t rounds) {
+	std::atomic_int inside {0};
+	std::atomic_bool broken {false};
+	uint64_t value = 0;
+	std::vector<std::thread> ths;
+	for (size_t t = 0; t < threads; t++) ths.emplace_back([&](){
+		for (size_t i = 0; i < rounds; i++) {
+			std::lock_guard<L> lk {lock};
+			if (inside.fetch_add(1)) broken = true;
+			value++;
+			inside.fetch_sub(1);
+		}
+	});
+	for (auto & th : ths) th.join();
+	TEST(!broken);
+	TEST(value == threads * rounds);
+}
+
+void tests::synchro_tests() {
+	tlog << "STARTING SYNCHRO TESTS";
+	
+	tlog << "RW LOCKS:";
+	{
+		asterales::rw_mutex rwm;
+		rw_exclusion(rwm, 8, 20000);
+		asterales::rw_spinlock rws;
+		rw_exclusion(rws, 4, 20000);
+		
+		// more concurrent readers than the old 8 bit counter could hold
+		std::vector<std::thread> readers;
+		std::atomic_size_t in {0};
+		std::atomic_bool go {false};
+		for (int i = 0; i < 300; i++) readers.emplace_back([&](){
+			rwm.read_access();
+			in++;
+			while (!go) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			rwm.read_done();
+		});
+		while (in.load() < 300) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		bool taken = rwm.write_lock_try();
+		TEST(!taken);
+		go = true;
+		for (auto & th : readers) th.join();
+		taken = rwm.write_lock_try();
+		TEST(taken);
+		taken = rwm.read_access_try();
+		TEST(!taken);
+		rwm.write_to_read();
+		taken = rwm.read_access_try();
+		TEST(taken);
+		taken = rwm.write_lock_try();
+		TEST(!taken);
+		rwm.read_done();
+		rwm.read_done();
+		taken = rwm.write_lock_try();
+		TEST(taken);
+		rwm.write_unlock();
+	}
+	
+	tlog << "QUEUE LOCKS:";
+	{
+		asterales::fifo_mutex fm;
+		mutex_exclusion(fm, 8, 20000);
+		asterales::fifo_spinlock fs;
+		mutex_exclusion(fs, 4, 20000);
+		
+		bool taken = fm.try_lock();
+		TEST(taken);
+		taken = fm.try_lock();
+		TEST(!taken);
+		std::atomic_bool got {false};
+		std::thread waiter {[&](){
+			fm.lock();
+			got = true;
+			fm.unlock();
+		}};
+		std::this_thread::sleep_for(std::chrono::milliseconds(20)); // long enough for the waiter to park
+		TEST(!got);
+		fm.unlock();
+		waiter.join();
+		TEST(got);
+		
+		// a thread holding two at once needs two nodes from its cache
+		asterales::fifo_mutex other;
+		fm.lock();
+		other.lock();
+		other.unlock();
+		fm.unlock();
+	}
+	
+	tlog << "SPINLOCK:";
+	{
+		asterales::spinlock sl;
+		asterales::lock_stats ls;
+		sl.set_stats(&ls);
+		mutex_exclusion(sl, 8, 20000);
+		TEST(ls.acquisitions.load() == 8 * 20000);
+		TEST(ls.contended.load() <= ls.acquisitions.load());
+		
+		// a holder that sleeps pushes waiters past the spin and onto the futex
+		sl.lock();
+		std::thread waiter {[&sl](){
+			sl.lock();
+			sl.unlock();
+		}};
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		sl.unlock();
+		waiter.join();
+		TEST(ls.parked.load() > 0);
+		bool taken = sl.try_lock();
+		TEST(taken);
+		taken = sl.try_lock();
+		TEST(!taken);
+		sl.unlock();
+		tlog << "  " << ls.acquisitions.load() << " acquisitions, " << ls.contended.load() << " contended, " << ls.parked.load() << " parked";
+	}
+	
+	tlog << "SYNCHRO TESTS DONE";
+}
@@ -29,9 +29,15 @@ int main(int argc, char * * argv) {
 		tests::strop_tests();
 	} else if (arg == "signal") {
 		tests::signal_tests();
+	} else if (arg == "cicada") {
+		tests::cicada_tests();
+	} else if (arg == "topology") {
+		tests::topology_tests();
+	} else if (arg == "synchro") {
+		tests::synchro_tests();
 	} else {
 		tlog << "unknown argument: \"" << arg << "\"";
-		tlog << "must be one of:\n> brassica\n> buffer_assembly\n> codon\n> strop\n> threadpool";
+		tlog << "must be one of:\n> brassica\n> buffer_assembly\n> cicada\n> codon\n> strop\n> synchro\n> threadpool\n> topology";
 		return 1;
 	}
 	return 0;
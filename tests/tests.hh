@@ -5,7 +5,11 @@
 
 #include "asterales/strop.hh"
 
+#ifdef NDEBUG
+#define TEST(cond) static_cast<void>(false && (cond)) // compiled but not evaluated, so anything only checked still counts as used, keep side effects out of it
+#else
 #define TEST(cond) assert(cond)
+#endif
 
 namespace tests {
 	void buffer_assembly_tests();
@@ -14,6 +18,9 @@ namespace tests {
 	void brassica_tests();
 	void strop_tests();
 	void signal_tests();
+	void cicada_tests();
+	void topology_tests();
+	void synchro_tests();
 }
 
 namespace util {
@@ -1,7 +1,23 @@
 #include "tests.hh"
 
+#include "asterales/noise.hh"
 #include "asterales/threadpool.hh"
 
+#include <array>
+#include <ctime>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+// each task spawns its children from inside the pool, so they land on that thread's deque and idle threads have to steal them
+static void spawn_tree(asterales::thread_pool & tp, std::atomic_size_t & leaves, unsigned int depth) {
+	if (!depth) {
+		leaves++;
+		return;
+	}
+	for (int i = 0; i < 2; i++) tp.enqueue(asterales::task_lambda<void>([&tp, &leaves, depth](){ spawn_tree(tp, leaves, depth - 1); }));
+}
+
 void tests::threadpool_tests() {
 	asterales::thread_pool tpt;
 	int i = 0;
@@ -19,6 +35,307 @@ void tests::threadpool_tests() {
 	
 	printf("%i\n", i);
 	
+	auto t3 = asterales::task_lambda<void>([](){ throw std::runtime_error {"task failure"}; });
+	auto t3f = t3->get_future();
+	tpt.enqueue(std::move(t3));
+	bool caught = false;
+	try {
+		t3f.get();
+	} catch (std::runtime_error const &) {
+		caught = true;
+	}
+	TEST(caught);
+	
+	std::atomic_size_t leaves {0};
+	{
+		asterales::thread_pool nested {4};
+		nested.enqueue(asterales::task_lambda<void>([&nested, &leaves](){ spawn_tree(nested, leaves, 12); }));
+		while (leaves.load() < (1 << 12)) std::this_thread::yield();
+	}
+	TEST(leaves.load() == (1 << 12));
+	
+	// tasks still queued at destruction are run, not dropped
+	std::atomic_size_t drained {0};
+	{
+		asterales::thread_pool tp {2};
+		for (int j = 0; j < 1000; j++) tp.enqueue(asterales::task_lambda<void>([&drained](){ drained++; }));
+	}
+	TEST(drained.load() == 1000);
+	printf("%zu %zu\n", leaves.load(), drained.load());
+	
+	// pooled futures and fire and forget
+	{
+		asterales::thread_pool tp {2};
+		auto f1 = tp.submit([](){ return 21 * 2; });
+		auto f2 = tp.submit([](){ throw std::runtime_error {"submit failure"}; });
+		auto f3 = tp.submit([big = std::array<char, 256> {1}](){ return big[0]; }); // too big to sit inline
+		int v1 = f1.get();
+		TEST(v1 == 42);
+		caught = false;
+		try {
+			f2.get();
+		} catch (std::runtime_error const &) {
+			caught = true;
+		}
+		TEST(caught);
+		char v3 = f3.get();
+		TEST(v3 == 1);
+		
+		std::atomic_size_t posted {0};
+		for (int j = 0; j < 1000; j++) tp.post([&posted](){ posted++; });
+		for (int j = 0; j < 1000; j++) tp.submit([](){}); // futures dropped right away, the state goes back to the freelist once the task ran
+		auto f4 = tp.submit([&posted](){ return posted.load(); });
+		f4.wait();
+		TEST(f4.ready());
+		while (posted.load() < 1000) std::this_thread::yield();
+		
+		asterales::task t {[&posted](){ posted++; }};
+		asterales::task moved {std::move(t)};
+		TEST(!t && moved);
+		moved();
+		TEST(posted.load() == 1001);
+		printf("%i %zu\n", f1.valid() ? 1 : 0, posted.load());
+	}
+	
+	// parallel algorithms
+	{
+		asterales::thread_pool tp {4};
+		
+		std::vector<int> marks (10000, 0);
+		asterales::parallel_for(tp, 0, 10000, 0, [&marks](int j){ marks[j]++; });
+		TEST(std::count(marks.begin(), marks.end(), 1) == 10000);
+		
+		// every outer index runs an inner parallel_for from inside the pool
+		std::atomic_size_t inner {0};
+		asterales::parallel_for(tp, 0, 64, 1, [&](int){
+			asterales::parallel_for(tp, 0, 100, 7, [&inner](int){ inner++; });
+		});
+		TEST(inner.load() == 6400);
+		
+		uint64_t sum = asterales::parallel_reduce(tp, uint64_t {1}, uint64_t {100001}, 0, uint64_t {0}, [](uint64_t acc, uint64_t j){ return acc + j; }, [](uint64_t a, uint64_t b){ return a + b; });
+		TEST(sum == 5000050000ull);
+		
+		std::string ordered = asterales::parallel_reduce(tp, 0, 26, 3, std::string {}, [](std::string acc, int j){ return acc + static_cast<char>('a' + j); }, [](std::string a, std::string const & b){ return a + b; });
+		TEST(ordered == "abcdefghijklmnopqrstuvwxyz");
+		
+		std::mt19937_64 rng {1};
+		asterales::simplex noise {rng};
+		std::vector<double> xs (4096), par (4096);
+		for (size_t j = 0; j < xs.size(); j++) xs[j] = j * 0.01;
+		asterales::parallel_transform(tp, xs.begin(), xs.end(), par.begin(), 0, [&noise](double x){ return noise.generate(x, x * 0.5); });
+		bool same = true;
+		for (size_t j = 0; j < xs.size(); j++) same = same && par[j] == noise.generate(xs[j], xs[j] * 0.5);
+		TEST(same);
+		
+		caught = false;
+		try {
+			asterales::parallel_for(tp, 0, 1000, 10, [](int j){ if (j == 537) throw std::runtime_error {"parallel failure"}; });
+		} catch (std::runtime_error const &) {
+			caught = true;
+		}
+		TEST(caught);
+		printf("%zu %zu %s %s %i\n", std::count(marks.begin(), marks.end(), 1), inner.load(), std::to_string(sum).c_str(), ordered.c_str(), same && caught ? 1 : 0);
+	}
+	
+	// continuations and task graphs
+	{
+		asterales::thread_pool tp {2};
+		
+		auto chained = tp.submit([](){ return 20; }).then(tp, [](int v){ return v + 1; }).then(tp, [](int v){ return std::to_string(v * 2); });
+		std::string got = chained.get();
+		TEST(got == "42");
+		
+		auto failed = tp.submit([]() -> int { throw std::runtime_error {"upstream"}; }).then(tp, [](int v){ return v; });
+		caught = false;
+		try {
+			failed.get();
+		} catch (std::runtime_error const &) {
+			caught = true;
+		}
+		TEST(caught);
+		
+		// a single pool thread that waits on its own subtask, it has to run that subtask itself instead of blocking
+		asterales::thread_pool solo {1};
+		auto outer = solo.submit([&solo](){ return solo.submit([](){ return 7; }).get() * 6; });
+		int got_outer = outer.get();
+		TEST(got_outer == 42);
+		
+		// waiting on something outside the pool sleeps once there is nothing to help with, instead of spinning for the whole wait
+		asterales::thread_pool other {1};
+		auto outside = solo.submit([&other](){
+			timespec before, after;
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &before);
+			int v = other.submit([](){ std::this_thread::sleep_for(std::chrono::milliseconds(300)); return 5; }).get();
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &after);
+			int64_t cpu_ms = (after.tv_sec - before.tv_sec) * 1000 + (after.tv_nsec - before.tv_nsec) / 1000000;
+			return cpu_ms < 100 ? v : -1;
+		});
+		int got_outside = outside.get();
+		TEST(got_outside == 5);
+		
+		// with idle threads around to take over, such a wait starts no thread of its own
+		asterales::thread_pool quad {4};
+		auto covered = quad.submit([&quad, &other](){
+			int v = other.submit([](){ std::this_thread::sleep_for(std::chrono::milliseconds(50)); return 6; }).get();
+			return quad.size() == 4 ? v : -1;
+		});
+		int got_covered = covered.get();
+		TEST(got_covered == 6);
+		
+		asterales::fork_join fj;
+		std::atomic_bool joined_late {false};
+		auto joiner = solo.submit([&](){
+			fj.fork();
+			other.post([&](){
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				joined_late = true;
+				fj.finish();
+			});
+			fj.join(solo);
+			return joined_late.load();
+		});
+		bool late = joiner.get();
+		TEST(late);
+		
+		std::vector<asterales::task_future<int>> parts;
+		for (int j = 0; j < 8; j++) parts.push_back(tp.submit([j](){ return j * j; }));
+		auto all = asterales::when_all(tp, std::move(parts));
+		std::vector<int> squares = all.get();
+		TEST(squares.size() == 8 && squares[3] == 9 && squares[7] == 49);
+		
+		std::atomic_bool release_slow {false};
+		std::vector<asterales::task_future<int>> racers;
+		racers.push_back(tp.submit([&release_slow](){ while (!release_slow) std::this_thread::yield(); return 1; }));
+		racers.push_back(tp.submit([](){ return 2; }));
+		auto first = asterales::when_any(tp, std::move(racers));
+		auto winner = first.get();
+		release_slow = true;
+		TEST(winner.first == 1 && winner.second == 2);
+		
+		std::vector<asterales::task_future<void>> voids;
+		for (int j = 0; j < 4; j++) voids.push_back(tp.submit([](){}));
+		asterales::when_all(tp, std::move(voids)).get();
+		
+		// diamond, b and c only start after a, d only after both
+		std::string order;
+		asterales::spinlock order_lock;
+		auto log = [&order, &order_lock](char c){ std::lock_guard<asterales::spinlock> lk {order_lock}; order += c; };
+		asterales::task_graph g;
+		auto a = g.add([&log](){ log('a'); });
+		auto b = g.add([&log](){ log('b'); });
+		auto c = g.add([&log](){ log('c'); });
+		auto d = g.add([&log](){ log('d'); });
+		g.precede(a, b);
+		g.precede(a, c);
+		g.precede(b, d);
+		g.precede(c, d);
+		g.run(tp).get();
+		TEST(order.size() == 4 && order.front() == 'a' && order.back() == 'd');
+		g.run(tp).get(); // runs again from scratch
+		TEST(order.size() == 8 && order[4] == 'a' && order[7] == 'd');
+		
+		asterales::task_graph bad;
+		std::atomic_bool after_ran {false};
+		auto boom = bad.add([](){ throw std::runtime_error {"node failure"}; });
+		auto after = bad.add([&after_ran](){ after_ran = true; });
+		bad.precede(boom, after);
+		caught = false;
+		try {
+			bad.run(tp).get();
+		} catch (std::runtime_error const &) {
+			caught = true;
+		}
+		TEST(caught && !after_ran);
+		printf("%s %i %zu %zu:%i %s %i\n", chained.valid() ? "?" : "42", outer.valid() ? 0 : 42, squares.size(), winner.first, winner.second, order.c_str(), caught && !after_ran ? 1 : 0);
+	}
+	
+	// priority lanes, deadlines and cancellation
+	{
+		asterales::thread_pool tp {1};
+		std::atomic_bool gate {false};
+		tp.post([&gate](){ while (!gate) std::this_thread::yield(); });
+		
+		std::string order;
+		asterales::task_options interactive, background;
+		interactive.lane = asterales::priority::interactive;
+		background.lane = asterales::priority::background;
+		for (int j = 0; j < 8; j++) tp.post([&order](){ order += 'b'; }, background);
+		tp.post([&order](){ order += 'i'; }, interactive);
+		
+		// a flood of interactive work still lets the background lane through now and then
+		for (int j = 0; j < 64; j++) tp.post([&order](){ order += 'I'; }, interactive);
+		
+		asterales::task_options late;
+		late.deadline = std::chrono::steady_clock::now() - std::chrono::milliseconds(1);
+		auto expired = tp.submit([](){ return 1; }, late);
+		
+		asterales::task_options cancellable;
+		cancellable.token = asterales::cancel_token::make();
+		std::atomic_bool cancelled_ran {false};
+		tp.post([&cancelled_ran](){ cancelled_ran = true; }, cancellable);
+		cancellable.token.cancel();
+		
+		gate = true;
+		bool dropped = false;
+		try {
+			expired.get();
+		} catch (asterales::exception::task_dropped const &) {
+			dropped = true;
+		}
+		TEST(dropped);
+		tp.submit([](){}, background).get();
+		while (order.size() < 73) std::this_thread::yield();
+		TEST(order.front() == 'i');
+		TEST(order.find('b') < order.rfind('I'));
+		TEST(!cancelled_ran);
+		
+		auto is = tp.stats(asterales::priority::interactive);
+		auto ns = tp.stats(asterales::priority::normal);
+		auto bs = tp.stats(asterales::priority::background);
+		TEST(is.executed == 65 && bs.executed == 9);
+		TEST(ns.dropped == 2 && ns.executed >= 3);
+		TEST(bs.wait_max_ns > 0 && is.wait_total_ns >= is.wait_max_ns);
+		printf("%c %i %i %i %zu %zu %zu\n", order.front(), order.find('b') < order.rfind('I') ? 1 : 0, dropped ? 1 : 0, cancelled_ran ? 0 : 1, size_t(is.executed), size_t(bs.executed), size_t(ns.dropped));
+	}
+	
+	// growing, shrinking and blocking compensation
+	{
+		asterales::thread_pool tp {1, 4};
+		tp.set_idle_timeout(std::chrono::milliseconds(50));
+		TEST(tp.size() == 1);
+		std::atomic_size_t slow {0};
+		for (int j = 0; j < 64; j++) tp.post([&slow](){ std::this_thread::sleep_for(std::chrono::milliseconds(2)); slow++; });
+		size_t peak = 1;
+		while (slow.load() < 64) {
+			peak = std::max(peak, tp.size());
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		TEST(peak > 1 && peak <= 4);
+		for (int j = 0; j < 100 && tp.size() > 1; j++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		TEST(tp.size() == 1);
+		
+		// both threads of a fixed pool block, the compensating threads still get the third task through
+		asterales::thread_pool fixed {2};
+		std::atomic_bool unblock {false};
+		std::atomic_size_t blocked_done {0};
+		for (int j = 0; j < 2; j++) fixed.post([&](){
+			fixed.blocking([&](){ while (!unblock) std::this_thread::sleep_for(std::chrono::milliseconds(1)); });
+			blocked_done++;
+		});
+		auto third = fixed.submit([](){ return 3; });
+		int got_third = third.get();
+		TEST(got_third == 3);
+		TEST(fixed.size() > 2);
+		unblock = true;
+		while (blocked_done.load() < 2) std::this_thread::yield();
+		for (int j = 0; j < 100 && fixed.size() > 2; j++) {
+			fixed.post([](){});
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		TEST(fixed.size() == 2);
+		printf("%zu %zu %zu\n", peak, tp.size(), fixed.size());
+	}
+	
 	/*
 	std::vector<unsigned char> pixels;
 	auto taskF = tpt.enqueue<void>([](std::string folderPath, uint32_t width, uint32_t height, std::vector<unsigned char> &&pixels)
@@ -0,0 +1,85 @@
+#include "tests.hh"
+
+#include "asterales/topology.hh"
+#include "asterales/threadpool.hh"
+
+#include <algorithm>
+#include <climits>
+
+#include <sched.h>
+
+namespace topology = asterales::topology;
+
+void tests::topology_tests() {
+	tlog << "STARTING TOPOLOGY TESTS\n";
+	
+	tlog << "CPU LISTS:";
+	{
+		TEST((topology::parse_list("0-3,8,10-11") == std::vector<unsigned int> {0, 1, 2, 3, 8, 10, 11}));
+		TEST((topology::parse_list("5") == std::vector<unsigned int> {5}));
+		TEST(topology::parse_list("").empty());
+	}
+	
+	tlog << "MACHINE:";
+	topology::machine const & sys = topology::get();
+	{
+		TEST(!sys.cpus.empty());
+		TEST(!sys.nodes.empty());
+		size_t counted = 0;
+		for (auto const & n : sys.nodes) {
+			TEST(!n.cpus.empty());
+			for (unsigned int id : n.cpus) TEST(sys.find(id) && sys.find(id)->node == n.id);
+			counted += n.cpus.size();
+		}
+		TEST(counted == sys.cpus.size());
+		tlog << "  " << sys.cpus.size() << " cpus on " << sys.nodes.size() << " nodes";
+	}
+	
+	tlog << "PLACEMENT:";
+	{
+		topology::placement pl;
+		TEST(pl.assign(0).empty());
+		TEST(pl.node_of(0) == topology::npos);
+		TEST(sys.node_index(UINT_MAX) == topology::npos);
+		for (auto policy : {topology::placement::policy::compact, topology::placement::policy::scatter, topology::placement::policy::node}) {
+			pl.p = policy;
+			for (size_t i = 0; i < sys.cpus.size() * 2; i++) {
+				auto cpus = pl.assign(i);
+				TEST(!cpus.empty());
+				for (unsigned int id : cpus) TEST(sys.find(id));
+				TEST(pl.node_of(i) < sys.nodes.size());
+			}
+			// a plan matches assign and node_of thread by thread
+			auto plan = pl.plan(sys.cpus.size() * 2);
+			for (size_t i = 0; i < plan.size(); i++) TEST(plan[i].cpus == pl.assign(i) && plan[i].node == pl.node_of(i));
+		}
+		
+		// compact hands out every allowed cpu once before repeating
+		pl.p = topology::placement::policy::compact;
+		std::vector<unsigned int> seen;
+		for (size_t i = 0; i < sys.cpus.size(); i++) seen.push_back(pl.assign(i).front());
+		std::sort(seen.begin(), seen.end());
+		TEST(std::unique(seen.begin(), seen.end()) == seen.end());
+		
+		// a restriction is honoured
+		pl.cpus = { sys.cpus.back().id };
+		TEST((pl.assign(3) == std::vector<unsigned int> { sys.cpus.back().id }));
+		
+		std::thread th { [&sys](){
+			bool pinned = topology::pin_self({ sys.cpus.front().id });
+			TEST(pinned);
+			TEST(static_cast<unsigned int>(sched_getcpu()) == sys.cpus.front().id);
+		} };
+		th.join();
+		
+		asterales::thread_pool pool {2};
+		pool.set_placement(pl);
+		auto t = asterales::task_lambda<int>([](){ return sched_getcpu(); });
+		auto f = t->get_future();
+		pool.enqueue(std::move(t));
+		int ran_on = f.get();
+		TEST(static_cast<unsigned int>(ran_on) == sys.cpus.back().id);
+	}
+	
+	tlog << "\nTOPOLOGY TESTS DONE";
+}